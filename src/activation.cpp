@@ -26,12 +26,10 @@ namespace Ember {
             for (usize prev = 0; prev < previous.values.size(); prev++)
                 values.data[prev] = internal::activations::ReLU(previous.values.data[prev]);
         }
-        Tensor ReLU::backward(const Layer& previous, const Tensor& gradOutput) const {
-            Tensor result(gradOutput.dims());
+        void ReLU::backward(const Layer& previous, const Tensor& gradOutput, Tensor& gradInput) const {
+            gradInput.resize(gradOutput.dims());
             for (usize prev = 0; prev < gradOutput.size(); prev++)
-                result.data[prev] = gradOutput.data[prev] * internal::activations::derivatives::ReLU(previous.values.data[prev]);
-
-            return result;
+                gradInput.data[prev] = gradOutput.data[prev] * internal::activations::derivatives::ReLU(previous.values.data[prev]);
         }
 
 
@@ -39,12 +37,10 @@ namespace Ember {
             for (usize prev = 0; prev < previous.values.size(); prev++)
                 values.data[prev] = internal::activations::CReLU(previous.values.data[prev]);
         }
-        Tensor CReLU::backward(const Layer& previous, const Tensor& gradOutput) const {
-            Tensor result(gradOutput.dims());
+        void CReLU::backward(const Layer& previous, const Tensor& gradOutput, Tensor& gradInput) const {
+            gradInput.resize(gradOutput.dims());
             for (usize prev = 0; prev < gradOutput.size(); prev++)
-                result.data[prev] = gradOutput.data[prev] * internal::activations::derivatives::CReLU(previous.values.data[prev]);
-
-            return result;
+                gradInput.data[prev] = gradOutput.data[prev] * internal::activations::derivatives::CReLU(previous.values.data[prev]);
         }
 
 
@@ -75,11 +71,11 @@ namespace Ember {
                 }
             }
         }
-        Tensor Softmax::backward([[maybe_unused]] const Layer& previous, const Tensor& gradOutput) const {
+        void Softmax::backward([[maybe_unused]] const Layer& previous, const Tensor& gradOutput, Tensor& gradInput) const {
             const usize batchSize = gradOutput.dim(0);
             const usize numClasses = gradOutput.dim(1);
 
-            Tensor result(batchSize, numClasses);
+            gradInput.resize(batchSize, numClasses);
 
             for (usize sample = 0; sample < batchSize; sample++) {
                 float dot = 0.0f;
@@ -87,10 +83,8 @@ namespace Ember {
                     dot += values[sample, i] * gradOutput[sample, i];
 
                 for (usize i = 0; i < numClasses; i++)
-                    result[sample, i] = values[sample, i] * (gradOutput[sample, i] - dot);
+                    gradInput[sample, i] = values[sample, i] * (gradOutput[sample, i] - dot);
             }
-
-            return result;
         }
     }
 }
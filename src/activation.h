@@ -11,7 +11,7 @@ namespace Ember {
         struct ReLU : internal::NonComputeLayer {
             void forward(const Layer& previous) override;
 
-            Tensor backward(const Layer& previous, const Tensor& gradOutput) const override;
+            void backward(const Layer& previous, const Tensor& gradOutput, Tensor& gradInput) const override;
 
             std::unique_ptr<Layer> clone() override {
                 return std::make_unique<ReLU>(*this);
@@ -25,7 +25,7 @@ namespace Ember {
         struct CReLU : internal::NonComputeLayer {
             void forward(const Layer& previous) override;
 
-            Tensor backward(const Layer& previous, const Tensor& gradOutput) const override;
+            void backward(const Layer& previous, const Tensor& gradOutput, Tensor& gradInput) const override;
 
             std::unique_ptr<Layer> clone() override {
                 return std::make_unique<CReLU>(*this);
@@ -39,7 +39,7 @@ namespace Ember {
         struct Softmax : internal::NonComputeLayer {
             void forward(const Layer& previous) override;
 
-            Tensor backward(const Layer& previous, const Tensor& gradOutput) const override;
+            void backward(const Layer& previous, const Tensor& gradOutput, Tensor& gradInput) const override;
 
             std::unique_ptr<Layer> clone() override {
                 return std::make_unique<Softmax>(*this);
@@ -0,0 +1,97 @@
+#pragma once
+
+#include "types.h"
+
+#include <cblas.h>
+#include <vector>
+#include <bit>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+// Builds of OpenBLAS without bf16 support declare cblas_sbgemm
+// but do not export it, so it is resolved at load time if present
+#if defined(__GNUC__) && !defined(_WIN32)
+#pragma weak cblas_sbgemm
+#endif
+
+namespace Ember::internal {
+    // Rounds to the nearest bf16, ties to even
+    inline u16 toBf16(const float value) {
+        const u32 bits = std::bit_cast<u32>(value);
+        // Keep NaNs quiet instead of rounding them to infinity
+        if ((bits & 0x7FFFFFFF) > 0x7F800000)
+            return static_cast<u16>((bits >> 16) | 0x40);
+        return static_cast<u16>((bits + 0x7FFF + ((bits >> 16) & 1)) >> 16);
+    }
+
+    inline float fromBf16(const u16 value) {
+        return std::bit_cast<float>(static_cast<u32>(value) << 16);
+    }
+
+    inline void toBf16(const float* in, u16* out, const usize size) {
+        #pragma omp parallel for simd if (size > 1 << 16)
+        for (usize i = 0; i < size; i++)
+            out[i] = toBf16(in[i]);
+    }
+
+    inline void toBf16(const float* in, std::vector<u16>& out, const usize size) {
+        out.resize(size);
+        toBf16(in, out.data(), size);
+    }
+
+    // True if OpenBLAS has a bf16 GEMM and the CPU runs it natively
+    // with AVX512-BF16 or AMX, otherwise it would be slower than sgemm
+    inline bool hasBf16Gemm() {
+        static const bool supported = [] {
+            #if defined(__GNUC__) && !defined(_WIN32) && (defined(__x86_64__) || defined(__i386__))
+                if (&cblas_sbgemm == nullptr)
+                    return false;
+
+                u32 eax, ebx, ecx, edx;
+                if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+                    return false;
+                const bool amxBf16 = edx & (1u << 22);
+
+                __get_cpuid_count(7, 1, &eax, &ebx, &ecx, &edx);
+                const bool avx512Bf16 = eax & (1u << 5);
+
+                return amxBf16 || avx512Bf16;
+            #else
+                return false;
+            #endif
+        }();
+        return supported;
+    }
+
+    // C = alpha * op(A) * op(B) + beta * C for row major bf16 A and B
+    // and fp32 C, products are accumulated in fp32
+    inline void bf16gemm(const CBLAS_TRANSPOSE transA, const CBLAS_TRANSPOSE transB, const blasint M, const blasint N, const blasint K,
+     const float alpha, const u16* A, const blasint lda, const u16* B, const blasint ldb, const float beta, float* C, const blasint ldc) {
+        if (hasBf16Gemm()) {
+            cblas_sbgemm(CblasRowMajor, transA, transB, M, N, K, alpha, A, lda, B, ldb, beta, C, ldc);
+            return;
+        }
+
+        // Only reached when a layer's flag is set directly, Network
+        // refuses bf16 GEMMs without native support. Widen both operands
+        // and use sgemm, which gives the same result since every bf16
+        // is exactly a float
+        thread_local std::vector<float> wideA;
+        thread_local std::vector<float> wideB;
+
+        const usize sizeA = static_cast<usize>(transA == CblasTrans ? K : M) * lda;
+        const usize sizeB = static_cast<usize>(transB == CblasTrans ? N : K) * ldb;
+
+        wideA.resize(sizeA);
+        wideB.resize(sizeB);
+
+        for (usize i = 0; i < sizeA; i++)
+            wideA[i] = fromBf16(A[i]);
+        for (usize i = 0; i < sizeB; i++)
+            wideB[i] = fromBf16(B[i]);
+
+        cblas_sgemm(CblasRowMajor, transA, transB, M, N, K, alpha, wideA.data(), lda, wideB.data(), ldb, beta, C, ldc);
+    }
+}
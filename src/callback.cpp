@@ -66,7 +66,7 @@ namespace Ember::callbacks {
 
         if (current < best) {
             best = current;
-            saveParams(path, learner->net);
+            saveParams(path, learner->testedNet ? *learner->testedNet : learner->net);
         }
     }
 }
\ No newline at end of file
@@ -279,15 +279,16 @@ namespace Ember::chess {
 
     bool Board::isCapture(const Move m) const { return ((1ULL << m.to() & pieces(~stm)) || m.typeOf() == EN_PASSANT); }
 
-    std::vector<float> Board::asInputLayer() const {
-        const auto getFeature = [this](const Color pieceColor, const Square square) {
-            const bool enemy       = stm != pieceColor;
-            const int  squareIndex = (stm == BLACK) ? flipRank(square) : static_cast<int>(square);
+    // Index of a piece in the input layer from the perspective of the side to move
+    usize inputFeature(const Color stm, const Color pieceColor, const PieceType pt, const Square square) {
+        const bool enemy       = stm != pieceColor;
+        const int  squareIndex = (stm == BLACK) ? flipRank(square) : static_cast<int>(square);
 
-            return enemy * 64 * 6 + getPiece(square) * 64 + squareIndex;
-        };
+        return enemy * 64 * 6 + pt * 64 + squareIndex;
+    }
 
-        std::vector<float> res(2 * 6 * 64);
+    std::vector<float> Board::asInputLayer() const {
+        std::vector<float> res(NUM_INPUT_FEATURES);
 
         u64 whitePieces = pieces(WHITE);
         u64 blackPieces = pieces(BLACK);
@@ -295,7 +296,7 @@ namespace Ember::chess {
         while (whitePieces) {
             const Square sq = popLSB(whitePieces);
 
-            const usize feature = getFeature(WHITE, sq);
+            const usize feature = inputFeature(stm, WHITE, getPiece(sq), sq);
 
             res[feature] = true;
         }
@@ -303,7 +304,7 @@ namespace Ember::chess {
         while (blackPieces) {
             const Square sq = popLSB(blackPieces);
 
-            const usize feature = getFeature(BLACK, sq);
+            const usize feature = inputFeature(stm, BLACK, getPiece(sq), sq);
 
             res[feature] = true;
         }
@@ -311,6 +312,67 @@ namespace Ember::chess {
         return res;
     }
 
+    std::array<i32, MAX_ACTIVE_FEATURES> Board::asInputIndices() const {
+        std::array<i32, MAX_ACTIVE_FEATURES> res;
+        res.fill(-1);
+
+        usize numActive = 0;
+        u64 occupied = pieces();
+
+        while (occupied && numActive < MAX_ACTIVE_FEATURES) {
+            const Square sq = popLSB(occupied);
+            const Color pieceColor = readBit(pieces(WHITE), sq) ? WHITE : BLACK;
+
+            res[numActive++] = inputFeature(stm, pieceColor, getPiece(sq), sq);
+        }
+
+        return res;
+    }
+
+    PackedBoard Board::pack(const i16 eval, const u8 wdl) const {
+        PackedBoard packed{};
+
+        packed.occupancy = pieces();
+        packed.eval = eval;
+        packed.wdl = wdl;
+        packed.stm = stm;
+
+        usize idx = 0;
+        u64 occupied = pieces();
+
+        while (occupied && idx < 32) {
+            const Square sq = popLSB(occupied);
+            const u8 piece = getPiece(sq) | (readBit(pieces(BLACK), sq) << 3);
+
+            packed.pieces[idx / 2] |= piece << (4 * (idx % 2));
+            idx++;
+        }
+
+        return packed;
+    }
+
+    std::array<i32, MAX_ACTIVE_FEATURES> PackedBoard::asInputIndices() const {
+        std::array<i32, MAX_ACTIVE_FEATURES> res;
+        res.fill(-1);
+
+        const auto sideToMove = static_cast<Color>(stm);
+
+        usize idx = 0;
+        u64 occupied = occupancy;
+
+        while (occupied && idx < MAX_ACTIVE_FEATURES) {
+            const Square sq = popLSB(occupied);
+            const u8 piece = (pieces[idx / 2] >> (4 * (idx % 2))) & 0xF;
+
+            const Color pieceColor = (piece & 0b1000) ? BLACK : WHITE;
+            const auto pt = static_cast<PieceType>(piece & 0b111);
+
+            res[idx++] = inputFeature(sideToMove, pieceColor, pt, sq);
+        }
+
+        return res;
+    }
+
     void Board::move(const Move m) {
         epSquare       = NO_SQUARE;
         Square    from = m.from();
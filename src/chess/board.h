@@ -79,8 +79,31 @@ namespace Ember::chess {
     constexpr std::array<Square, 4> ROOK_CASTLE_END_SQ = { d8, f8, d1, f1 };
     constexpr std::array<Square, 4> KING_CASTLE_END_SQ = { c8, g8, c1, g1 };
 
+    // Size of the input layer and the most features a legal position can activate
+    constexpr usize NUM_INPUT_FEATURES = 2 * 6 * 64;
+    constexpr usize MAX_ACTIVE_FEATURES = 32;
+
     class Move;
 
+    // Fixed size position record used by the binary data format
+    // Pieces are stored 4 bits each for the occupied squares in order
+    // from a1 to h8, the low 3 bits hold the piece type and the high
+    // bit is set for black pieces
+    struct PackedBoard {
+        u64 occupancy;
+        std::array<u8, 16> pieces;
+        i16 eval;
+        // 0 for a black win, 1 for a draw, 2 for a white win
+        u8 wdl;
+        u8 stm;
+        std::array<u8, 4> padding;
+
+        // Same features as Board::asInputIndices without building a board
+        std::array<i32, MAX_ACTIVE_FEATURES> asInputIndices() const;
+    };
+
+    static_assert(sizeof(PackedBoard) == 32);
+
     struct Board {
         // Index is based on square, returns the piece type
         std::array<PieceType, 64> mailbox;
@@ -128,6 +151,10 @@ namespace Ember::chess {
         bool      isCapture(Move m) const;
 
         std::vector<float> asInputLayer() const;
+        // Indices of the set features of asInputLayer, padded with -1
+        std::array<i32, MAX_ACTIVE_FEATURES> asInputIndices() const;
+
+        PackedBoard pack(i16 eval, u8 wdl) const;
 
         void move(Move m);
 
@@ -7,168 +7,241 @@
 #include <filesystem>
 #include <algorithm>
 #include <fstream>
-#include <random>
-#include <chrono>
+#include <cstring>
+#include <limits>
 #include <omp.h>
 
 #include "../util.h"
 
 namespace Ember::dataloaders::chess {
-    BulletTextDataLoader::BulletTextDataLoader(const std::string& filePath, const u64 batchSize, const usize evalScale, const u64 threads) : DataLoader(batchSize, threads), filePath(filePath), evalScale(evalScale) {
-        fmt::println("Attempting to open file '{}'", filePath);
-        if (!std::filesystem::exists(filePath) || std::filesystem::is_directory(filePath))
-            exitWithMsg("Data file does not exist or is a directory: " + filePath, 1);
-
+    using Ember::chess::NUM_INPUT_FEATURES;
+    using Ember::chess::MAX_ACTIVE_FEATURES;
+    using Ember::chess::PackedBoard;
+
+    // Positions the binary loader reads together when filling its shuffle buffer
+    constexpr u64 POSITIONS_PER_CHUNK = 1 << 16;
+
+    // Sizes and clears a batch for the given number of positions
+    void prepareBatch(internal::DataPoint& data, const usize size, const bool sparseInputs) {
+        if (sparseInputs) {
+            data.sparseInput.resize(size, NUM_INPUT_FEATURES, MAX_ACTIVE_FEATURES);
+            data.sparseInput.clear();
+        }
+        else {
+            data.input.resize(size, NUM_INPUT_FEATURES);
+            data.input.fill(0);
+        }
+        data.target.resize(size, static_cast<usize>(1));
+        data.target.fill(0);
+    }
 
-        std::string l;
-        file = std::ifstream(filePath);
-        while (std::getline(file, l))
-            numSamples++;
+    // Writes the features of one position into row i of a batch
+    void writeFeatures(internal::DataPoint& data, const usize i, const std::array<i32, MAX_ACTIVE_FEATURES>& features, const bool sparseInputs) {
+        if (sparseInputs) {
+            std::memcpy(data.sparseInput.sample(i), features.data(), sizeof(i32) * features.size());
+            return;
+        }
 
-        fmt::println("Found {} positions", formatNum(numSamples));
+        for (const i32 feature : features) {
+            if (feature < 0)
+                break;
+            data.input[i, static_cast<usize>(feature)] = 1;
+        }
     }
 
-    void BulletTextDataLoader::loadBatch(const usize batchIdx) {
-        data[batchIdx].input.resize(batchSize, static_cast<usize>(2 * 6 * 64));
-        data[batchIdx].target.resize(batchSize, static_cast<usize>(1));
+    // Appends the non-blank lines in [begin, end) of a mapped file
+    void appendLines(const internal::MappedFile& file, const u64 begin, const u64 end, std::vector<std::string_view>& out) {
+        const auto* text = reinterpret_cast<const char*>(file.data);
+
+        u64 pos = begin;
+        while (pos < end) {
+            const void* newline = std::memchr(text + pos, '\n', end - pos);
+            const u64 lineEnd = newline ? static_cast<const char*>(newline) - text : end;
 
-        data[batchIdx].target.fill(0);
-        data[batchIdx].input.fill(0);
+            const std::string_view line(text + pos, lineEnd - pos);
+            pos = lineEnd + 1;
 
-        std::vector<std::vector<internal::DataPoint>> localData(threads);
+            // Null chars are included because windows uses encoding
+            // that places a \0 after every character
+            if (!std::ranges::all_of(line, [](const char c) { return c == '\0' || std::isspace(static_cast<unsigned char>(c)); }))
+                out.push_back(line);
+        }
+    }
 
-        std::string l;
-        std::vector<std::string> lines;
-        u64 linesRead = 0;
+    // Parses a "fen | eval | wdl" line into a packed position
+    PackedBoard parseLine(const std::string_view text) {
+        std::string line(text);
 
-        // Load lines into a buffer
-        while (linesRead < batchSize) {
-            if (!std::getline(file, l)) {
-                file = std::ifstream(filePath);
-                continue;
-            }
+        // Discard null chars because windows uses encoding that
+        // places a \0 after every character
+        std::erase_if(line, [](const char c) { return c == '\0'; });
 
-            // Discard null chars because windows uses encoding that
-            // places a \0 after every character
-            std::erase_if(l, [](const char c) { return c == '\0'; });
+        // Strip UTF-16 BOM if present
+        if (line.size() >= 2 && static_cast<unsigned char>(line[0]) == 0xFF && static_cast<unsigned char>(line[1]) == 0xFE)
+            line = line.substr(2);
 
-            if (std::ranges::all_of(l.begin(), l.end(), [](const char c) { return std::isspace(c); }))
-                continue;
+        const auto tokens = split(line, '|');
 
-            lines.emplace_back(l);
-            linesRead++;
-        }
+        if (tokens.size() != 3)
+            exitWithMsg(fmt::format("Expected 3 tokens, got {}. Failed to parse line: {}", tokens.size(), line), 1);
+        assert(tokens.size() == 3);
 
-        assert(lines.size() == batchSize);
+        const std::string& fen = tokens[0];
+        const float eval = std::clamp<float>(std::round(std::stof(tokens[1])), std::numeric_limits<i16>::min(), std::numeric_limits<i16>::max());
+        const auto wdl = static_cast<u8>(std::round(std::stof(tokens[2]) * 2));
 
-        std::vector<u64> shuffledIndexes;
-        shuffledIndexes.reserve(batchSize);
+        Ember::chess::Board board{};
+        board.loadFromFEN(fen);
 
-        // This is for batch shuffling
-        for (usize i = 0; i < batchSize; i++)
-            shuffledIndexes.push_back(i);
+        return board.pack(static_cast<i16>(eval), wdl);
+    }
 
-        unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
-        std::default_random_engine rng(seed);
+    // Appends the positions of the non-blank lines in [begin, end) of a
+    // mapped file, parsing them in parallel
+    void appendPositions(const internal::MappedFile& file, const u64 begin, const u64 end, const usize threads, std::vector<PackedBoard>& out) {
+        std::vector<std::string_view> lines;
+        appendLines(file, begin, end, lines);
 
-        // Shuffle the vector
-        std::ranges::shuffle(shuffledIndexes, rng);
+        const usize first = out.size();
+        out.resize(first + lines.size());
 
         #pragma omp parallel for num_threads(std::max<usize>(threads, 1))
-        for (usize i = 0; i < batchSize; i++) {
-            std::string& line = lines[shuffledIndexes[i]];
+        for (usize i = 0; i < lines.size(); i++)
+            out[first + i] = parseLine(lines[i]);
+    }
 
-            // Strip UTF-16 BOM if present
-            if (line.size() >= 2 && static_cast<unsigned char>(line[0]) == 0xFF && static_cast<unsigned char>(line[1]) == 0xFE)
-                line = line.substr(2);
+    // Writes a packed position into row i of a batch
+    void writePosition(internal::DataPoint& data, const usize i, const PackedBoard& position, const usize evalScale, const bool sparseInputs) {
+        writeFeatures(data, i, position.asInputIndices(), sparseInputs);
+        data.target[i, 0] = static_cast<float>(position.eval) * evalScale;
+    }
 
-            const auto tokens = split(line, '|');
+    u64 countCorrectEvals(const Tensor& output, const Tensor& target, const usize evalScale) {
+        u64 numCorrect = 0;
 
-            if (tokens.size() != 3)
-                exitWithMsg(fmt::format("Expected 3 tokens, got {}. Failed to parse line: {}", tokens.size(), line), 1);
-            assert(tokens.size() == 3);
+        for (usize i = 0; i < target.dim(0); i++)
+            numCorrect += (std::round(output[i, 0] / evalScale) == std::round(target[i, 0] / evalScale));
 
-            const std::string& fen = tokens[0];
-            const float eval = std::stof(tokens[1]);
-            // Token 2 is discarded b/c it's the WDL which is not
-            // used yet
+        return numCorrect;
+    }
 
-            Ember::chess::Board board{};
-            board.loadFromFEN(fen);
+    BulletTextDataLoader::BulletTextDataLoader(const std::string& filePath, const u64 batchSize, const usize evalScale, const u64 threads, const bool sparseInputs, const u64 shuffleBufferSize)
+        : DataLoader(batchSize, threads), filePath(filePath), evalScale(evalScale), sparseInputs(sparseInputs) {
+        fmt::println("Attempting to open file '{}'", filePath);
+        if (!std::filesystem::exists(filePath) || std::filesystem::is_directory(filePath))
+            exitWithMsg("Data file does not exist or is a directory: " + filePath, 1);
 
-            std::vector<float> input = board.asInputLayer();
+        mappedFile.open(filePath);
+        lineIndex = internal::LineIndex::open(filePath, mappedFile, threads);
+        numSamples = lineIndex.numLines;
 
-            std::memcpy(&data[batchIdx].input[i, 0], input.data(), sizeof(float) * input.size());
-            data[batchIdx].target[i, 0] = eval * evalScale;
-        }
-    }
+        if (numSamples < batchSize)
+            exitWithMsg(fmt::format("Data file has {} positions but the batch size is {}", numSamples, batchSize), 1);
 
-    void BulletTextDataLoader::loadTestSet() {
-        // Local file object, always reads the
-        // first batchSize samples for
-        // more consistent results
-        std::ifstream file(filePath);
+        // Chunks are parsed as they are read so draws
+        // come from the buffer instead of the mapped file
+        shuffleBuffer = internal::ShuffleBuffer<PackedBoard>(lineIndex.numChunks(), shuffleBufferSize, [this](const usize chunk, std::vector<PackedBoard>& out) {
+            appendPositions(mappedFile, lineIndex.chunkOffsets[chunk], lineIndex.chunkOffsets[chunk + 1], this->threads, out);
+        });
 
-        data[currBatch].input.resize(batchSize, static_cast<usize>(2 * 6 * 64));
-        data[currBatch].target.resize(batchSize, static_cast<usize>(1));
+        // Always tests on the first batchSize
+        // samples for more consistent results
+        for (usize chunk = 0; chunk < lineIndex.numChunks() && testPositions.size() < batchSize; chunk++)
+            appendPositions(mappedFile, lineIndex.chunkOffsets[chunk], lineIndex.chunkOffsets[chunk + 1], threads, testPositions);
 
-        data[currBatch].target.fill(0);
-        data[currBatch].input.fill(0);
+        if (testPositions.size() < batchSize)
+            exitWithMsg(fmt::format("Failed to load test batch. Is the data corrupted? Are there at least {} data points?", batchSize), 1);
+        testPositions.resize(batchSize);
 
-        std::vector<std::vector<internal::DataPoint>> localData(threads);
+        fmt::println("Found {} positions", formatNum(numSamples));
+    }
 
-        std::string l;
-        std::vector<std::string> lines;
-        u64 linesRead = 0;
+    void BulletTextDataLoader::loadBatch(const usize batchIdx) {
+        prepareBatch(data[batchIdx], batchSize, sparseInputs);
 
-        // Load lines into a buffer
-        while (linesRead < batchSize) {
-            if (!std::getline(file, l))
-                exitWithMsg(fmt::format("Failed to load test batch. Is the data corrupted? Are there at least {} data points?", batchSize), 1);
-            // Discard null chars because windows uses encoding that
-            // places a \0 after every character
-            std::erase_if(l, [](const char c) { return c == '\0'; });
+        std::vector<PackedBoard> positions(batchSize);
 
-            if (std::ranges::all_of(l.begin(), l.end(), [](const char c) { return std::isspace(c); }))
-                continue;
+        std::unique_lock lock(sourceMutex);
+        for (auto& position : positions)
+            position = shuffleBuffer.next();
+        lock.unlock();
 
-            lines.emplace_back(l);
-            linesRead++;
-        }
+        #pragma omp parallel for num_threads(batchThreads())
+        for (usize i = 0; i < batchSize; i++)
+            writePosition(data[batchIdx], i, positions[i], evalScale, sparseInputs);
+    }
+
+    void BulletTextDataLoader::loadTestBatch(internal::DataPoint& data, const u64 first, const u64 count) const {
+        assert(first + count <= testPositions.size());
+
+        prepareBatch(data, count, sparseInputs);
 
         #pragma omp parallel for num_threads(std::max<usize>(threads, 1))
-        for (usize i = 0; i < batchSize; i++) {
-            std::string& line = lines[i];
+        for (usize i = 0; i < count; i++)
+            writePosition(data, i, testPositions[first + i], evalScale, sparseInputs);
+    }
+
+    u64 BulletTextDataLoader::countCorrect(const Tensor& output, const Tensor& target) {
+        return countCorrectEvals(output, target, evalScale);
+    }
 
-            // Strip UTF-16 BOM if present
-            if (line.size() >= 2 && static_cast<unsigned char>(line[0]) == 0xFF && static_cast<unsigned char>(line[1]) == 0xFE)
-                line = line.substr(2);
 
-            const auto tokens = split(line, '|');
+    BulletBinaryDataLoader::BulletBinaryDataLoader(const std::string& filePath, const u64 batchSize, const usize evalScale, const u64 threads, const bool sparseInputs, const u64 shuffleBufferSize)
+        : DataLoader(batchSize, threads), filePath(filePath), evalScale(evalScale), sparseInputs(sparseInputs) {
+        fmt::println("Attempting to open file '{}'", filePath);
+        if (!std::filesystem::exists(filePath) || std::filesystem::is_directory(filePath))
+            exitWithMsg("Data file does not exist or is a directory: " + filePath, 1);
 
-            if (tokens.size() != 3)
-                exitWithMsg(fmt::format("Expected 3 tokens, got {}. Failed to parse line: {}", tokens.size(), line), 1);
-            assert(tokens.size() == 3);
+        file.open(filePath);
 
-            const std::string& fen = tokens[0];
-            const float eval = std::stof(tokens[1]);
+        if (file.size % sizeof(PackedBoard) != 0)
+            exitWithMsg(fmt::format("Data file size is not a multiple of {} bytes, is it a packed position file?", sizeof(PackedBoard)), 1);
 
-            Ember::chess::Board board{};
-            board.loadFromFEN(fen);
+        numSamples = file.size / sizeof(PackedBoard);
+        if (numSamples < batchSize)
+            exitWithMsg(fmt::format("Data file has {} positions but the batch size is {}", numSamples, batchSize), 1);
 
-            std::vector<float> input = board.asInputLayer();
+        // Chunks are copied into the buffer with one sequential
+        // read each so draws never touch the mapped file
+        shuffleBuffer = internal::ShuffleBuffer<PackedBoard>((numSamples + POSITIONS_PER_CHUNK - 1) / POSITIONS_PER_CHUNK, shuffleBufferSize, [this](const usize chunk, std::vector<PackedBoard>& out) {
+            const auto* filePositions = reinterpret_cast<const PackedBoard*>(file.data);
+            const u64 first = chunk * POSITIONS_PER_CHUNK;
+            out.insert(out.end(), filePositions + first, filePositions + std::min(numSamples, first + POSITIONS_PER_CHUNK));
+        });
 
-            std::memcpy(&data[currBatch].input[i, 0], input.data(), sizeof(float) * input.size());
-            data[currBatch].target[i, 0] = eval * evalScale;
-        }
+        fmt::println("Found {} positions", formatNum(numSamples));
     }
 
-    u64 BulletTextDataLoader::countCorrect(const Tensor& output, const Tensor& target) {
-        u64 numCorrect = 0;
+    void BulletBinaryDataLoader::loadBatch(const usize batchIdx) {
+        prepareBatch(data[batchIdx], batchSize, sparseInputs);
 
-        for (usize i = 0; i < target.dim(0); i++)
-            numCorrect += (std::round(output[i, 0] / evalScale) == std::round(target[i, 0] / evalScale));
+        std::vector<PackedBoard> positions(batchSize);
 
-        return numCorrect;
+        std::unique_lock lock(sourceMutex);
+        for (auto& position : positions)
+            position = shuffleBuffer.next();
+        lock.unlock();
+
+        #pragma omp parallel for num_threads(batchThreads())
+        for (usize i = 0; i < batchSize; i++)
+            writePosition(data[batchIdx], i, positions[i], evalScale, sparseInputs);
+    }
+
+    void BulletBinaryDataLoader::loadTestBatch(internal::DataPoint& data, const u64 first, const u64 count) const {
+        // Always the first batchSize positions for
+        // more consistent results
+        assert(first + count <= batchSize);
+
+        prepareBatch(data, count, sparseInputs);
+
+        const auto* positions = reinterpret_cast<const PackedBoard*>(file.data) + first;
+
+        #pragma omp parallel for num_threads(std::max<usize>(threads, 1))
+        for (usize i = 0; i < count; i++)
+            writePosition(data, i, positions[i], evalScale, sparseInputs);
+    }
+
+    u64 BulletBinaryDataLoader::countCorrect(const Tensor& output, const Tensor& target) {
+        return countCorrectEvals(output, target, evalScale);
     }
 }
\ No newline at end of file
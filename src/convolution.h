@@ -2,8 +2,16 @@
 
 #include "types.h"
 #include "layer.h"
+#include "winograd.h"
+#include "direct.h"
 
 namespace Ember::layers {
+    enum class ConvolutionAlgorithm {
+        IM2COL,   // Patches lowered to matrix products, any shape
+        WINOGRAD, // F(2x2, 3x3) transforms, 3x3 kernels with a stride of 1
+        DIRECT    // Accumulated in place over output channels, small patches
+    };
+
     struct Convolution : internal::ComputeLayer {
         // Weights are stored by kernel
         // Assuming the kernel is N x M
@@ -26,10 +34,44 @@ namespace Ember::layers {
         usize cols;
         usize inputChannels;
 
-        std::vector<float> patchMatrix;
+        // Forward lowers up to this many floats of patches at once, so
+        // small images are batched into one large matrix product
+        static constexpr usize MAX_PATCH_FLOATS = 1 << 22;
 
-        mutable std::vector<float> colGrad;
-        mutable std::vector<float> localPatch;
+        // Patch rows of a tile of samples, each followed by a 1 that
+        // multiplies the bias column of biasedWeights
+        std::vector<float> patchMatrix;
+        std::vector<float> biasedWeights;
+
+        // Keep the patches of the whole batch from the forward pass for
+        // the weight gradient instead of lowering them again, at the cost
+        // of batchSize * rows * patchSize() floats. Not used by Winograd
+        // or direct layers
+        bool cachePatches = false;
+        // Samples whose patches are in patchMatrix after the forward pass
+        usize cachedSamples = 0;
+
+        // Scratch of each thread running the backward pass
+        mutable std::vector<std::vector<float>> threadPatches;
+        mutable std::vector<std::vector<float>> threadColGrads;
+        mutable std::vector<std::vector<float>> threadWeightGrads;
+
+        // Picked by init, Winograd is used by the forward pass and the
+        // input gradient of 3x3 stride 1 layers with at least
+        // WINOGRAD_MIN_CHANNELS input and output channels, outside mixed
+        // precision. Direct kernels are used by layers with at most
+        // DIRECT_MAX_COLS weights per kernel, also in fp32 only. May be
+        // set after init to force a path
+        static constexpr usize WINOGRAD_MIN_CHANNELS = 32;
+        static constexpr usize DIRECT_MAX_COLS = 72;
+        ConvolutionAlgorithm algorithm = ConvolutionAlgorithm::IM2COL;
+
+        mutable std::vector<float> winogradKernels;
+        mutable std::vector<float> winogradInput;
+        mutable std::vector<float> winogradProducts;
+
+        std::vector<float> directKernels;
+        mutable std::vector<float> directWeights;
 
         Convolution(const usize numKernels, const usize kernelSize, const usize stride = 1) : ComputeLayer(0), numKernels(numKernels), kernelSize(kernelSize), stride(stride) {
             outX = outY = 0;
@@ -60,149 +102,276 @@ namespace Ember::layers {
 
             weights.resize(numKernels, cols);
 
-            patchMatrix.resize(rows * cols);
-
-            colGrad.resize(rows * cols);
-            localPatch.resize(rows * cols);
+            // With few channels the transforms cost more than the products they save
+            const bool winogradShape = kernelSize == 3 && stride == 1;
+            if (winogradShape && inputChannels >= WINOGRAD_MIN_CHANNELS && numKernels >= WINOGRAD_MIN_CHANNELS)
+                algorithm = ConvolutionAlgorithm::WINOGRAD;
+            // Lowering small patches costs more memory traffic than the matrix product saves
+            else if (cols <= DIRECT_MAX_COLS)
+                algorithm = ConvolutionAlgorithm::DIRECT;
+            else
+                algorithm = ConvolutionAlgorithm::IM2COL;
         }
 
-        // Forward pass
-        void forward(const Layer& previous) override {
-            const usize batchSize = values.dim(0);
+        bool usesWinograd() const { return algorithm == ConvolutionAlgorithm::WINOGRAD && !bf16Gemm; }
+        bool usesDirect() const { return algorithm == ConvolutionAlgorithm::DIRECT && !bf16Gemm; }
 
-            // Copy biases to output
-            for (usize i = 0; i < batchSize; i++) {
-                for (usize ox = 0; ox < outX; ox++) {
-                    for (usize oy = 0; oy < outY; oy++) {
-                        for (usize j = 0; j < numKernels; j++) {
-                            values[i, ox, oy, j] = biases[j];
-                        }
-                    }
-                }
-            }
+        // Floats per patch row, the patch then the bias input
+        usize patchSize() const { return cols + 1; }
 
-            for (usize i = 0; i < batchSize; i++) {
-                // Convert the image into columns
-                // The goal of this is to allow the use
-                // of OpenBLAS for the matrix math
-                usize row = 0;
-                for (usize ox = 0; ox < outX; ox++) {
-                    for (usize oy = 0; oy < outY; oy++) {
-                        float* rowPtr = &patchMatrix[row * cols];
-                        usize idx = 0;
-                        for (usize ch = 0; ch < inputChannels; ch++) {
-                            for (usize ky = 0; ky < kernelSize; ky++) {
-                                for (usize kx = 0; kx < kernelSize; kx++) {
-                                    const usize ix = ox * stride + kx;
-                                    const usize iy = oy * stride + ky;
-                                    rowPtr[idx++] = previous.values[i, ix, iy, ch];
-                                }
-                            }
+        // Writes the patch rows of a sample, ordered by output position
+        void lowerPatches(const Tensor& input, const usize sample, float* out) const {
+            const float* image = input.ptr() + sample * x * y * inputChannels;
+
+            for (usize ox = 0; ox < outX; ox++) {
+                for (usize oy = 0; oy < outY; oy++) {
+                    float* rowPtr = out + (ox * outY + oy) * patchSize();
+                    usize idx = 0;
+                    for (usize ch = 0; ch < inputChannels; ch++) {
+                        for (usize ky = 0; ky < kernelSize; ky++) {
+                            const float* inputRow = image + (ox * stride * y + oy * stride + ky) * inputChannels + ch;
+                            for (usize kx = 0; kx < kernelSize; kx++)
+                                rowPtr[idx++] = inputRow[kx * y * inputChannels];
                         }
-                        row++;
                     }
+                    rowPtr[cols] = 1.0f;
                 }
-
-                // Run the matrix math
-                cblas_sgemm(
-                    CblasRowMajor, CblasNoTrans, CblasTrans,
-                    rows, numKernels, cols,
-                    1.0f,
-                    patchMatrix.data(), cols,
-                    weights.ptr(), cols,
-                    1.0f,
-                    &values[i, 0, 0, 0], numKernels
-                );
             }
         }
 
-    // Returns gradInput, weightGrad, biasGrad
-    std::tuple<Tensor, Tensor, Tensor> backward(const Layer& previous, const Tensor& gradOutput) const override {
-        const usize batchSize = values.dim(0);
-        const usize outputSize = rows * numKernels;
+        // Forward pass
+        // Lowers tiles of samples to patch rows and runs one matrix
+        // product per tile, the bias column adds the biases
+        void forward(const Layer& previous) override {
+            const usize batchSize = values.dim(0);
+
+            cachedSamples = 0;
 
-        Tensor gradInput(previous.values.dims());
+            if (usesWinograd()) {
+                internal::winograd::transformKernels(weights.ptr(), numKernels, inputChannels, false, winogradKernels);
+                internal::winograd::correlate(previous.values.ptr(), batchSize, x, y, inputChannels, 0, winogradKernels, numKernels, outX, outY, biases.ptr(), values.ptr(), winogradInput, winogradProducts);
+                return;
+            }
 
-        Tensor weightGrad(weights.dims());
+            if (usesDirect()) {
+                internal::direct::transposeKernels(weights.ptr(), numKernels, cols, directKernels);
+                internal::direct::correlate(previous.values.ptr(), batchSize, x, y, inputChannels, kernelSize, stride, directKernels, numKernels, outX, outY, biases.ptr(), values.ptr());
+                return;
+            }
 
-        Tensor biasGrad(numKernels);
+            const usize tileSamples = cachePatches ? batchSize : std::clamp<usize>(MAX_PATCH_FLOATS / (rows * patchSize()), 1, batchSize);
 
-        for (usize i = 0; i < batchSize; i++) {
+            patchMatrix.resize(tileSamples * rows * patchSize());
+
+            biasedWeights.resize(numKernels * patchSize());
             for (usize k = 0; k < numKernels; k++) {
-                float sum = 0.0f;
-                for (usize ox = 0; ox < outX; ox++)
-                    for (usize oy = 0; oy < outY; oy++)
-                        sum += gradOutput[i, ox, oy, k];
-                biasGrad[k] += sum;
+                std::memcpy(&biasedWeights[k * patchSize()], weights.ptr() + k * cols, cols * sizeof(float));
+                biasedWeights[k * patchSize() + cols] = biases[k];
+            }
+
+            if (bf16Gemm) {
+                internal::toBf16(biasedWeights.data(), halfWeights, biasedWeights.size());
+                // Patches of every sample are kept for the backward pass
+                halfInput.resize(batchSize * rows * patchSize());
             }
+
+            for (usize first = 0; first < batchSize; first += tileSamples) {
+                const usize count = std::min(tileSamples, batchSize - first);
+
+                #pragma omp parallel for
+                for (usize s = 0; s < count; s++)
+                    lowerPatches(previous.values, first + s, &patchMatrix[s * rows * patchSize()]);
+
+                // (count * rows x patchSize) * (patchSize x numKernels)
+                if (bf16Gemm) {
+                    u16* halfPatches = halfInput.data() + first * rows * patchSize();
+                    internal::toBf16(patchMatrix.data(), halfPatches, count * rows * patchSize());
+
+                    internal::bf16gemm(
+                        CblasNoTrans, CblasTrans,
+                        count * rows, numKernels, patchSize(),
+                        1.0f,
+                        halfPatches, patchSize(),
+                        halfWeights.data(), patchSize(),
+                        0.0f,
+                        &values[first, 0, 0, 0], numKernels
+                    );
+                }
+                else {
+                    cblas_sgemm(
+                        CblasRowMajor, CblasNoTrans, CblasTrans,
+                        count * rows, numKernels, patchSize(),
+                        1.0f,
+                        patchMatrix.data(), patchSize(),
+                        biasedWeights.data(), patchSize(),
+                        0.0f,
+                        &values[first, 0, 0, 0], numKernels
+                    );
+                }
+            }
+
+            if (tileSamples == batchSize)
+                cachedSamples = batchSize;
         }
 
-        for (usize i = 0; i < batchSize; i++) {
-            usize row = 0;
-            for (usize ox = 0; ox < outX; ox++) {
-                for (usize oy = 0; oy < outY; oy++) {
-                    float* rowPtr = &localPatch[row * cols];
-                    usize idx = 0;
+        // Weight gradients come from one matrix product over the batch when
+        // the patches are at hand, otherwise each thread lowers its samples
+        // and sums into its own partial. The input gradient is scattered
+        // from each sample's patch gradients, or found with Winograd.
+        // Direct layers skip patches for both
+        void backward(const Layer& previous, const Tensor& gradOutput, Tensor& gradInput, Tensor& weightGrad, Tensor& biasGrad, const float scale) const override {
+            const usize batchSize = values.dim(0);
+            const usize outputSize = rows * numKernels;
 
-                    for (usize ch = 0; ch < inputChannels; ch++) {
-                        for (usize ky = 0; ky < kernelSize; ky++) {
-                            for (usize kx = 0; kx < kernelSize; kx++) {
-                                const usize ix = ox * stride + kx;
-                                const usize iy = oy * stride + ky;
-                                rowPtr[idx++] = previous.values[i, ix, iy, ch];
-                            }
-                        }
-                    }
-                    row++;
+            gradInput.resize(previous.values.dims());
+
+            for (usize i = 0; i < batchSize; i++) {
+                for (usize k = 0; k < numKernels; k++) {
+                    float sum = 0.0f;
+                    for (usize ox = 0; ox < outX; ox++)
+                        for (usize oy = 0; oy < outY; oy++)
+                            sum += gradOutput[i, ox, oy, k];
+                    biasGrad[k] += scale * sum;
                 }
             }
 
-            const float* goPtr = gradOutput.ptr() + i * outputSize;
+            if (usesDirect()) {
+                internal::direct::gradients(previous.values.ptr(), gradOutput.ptr(), batchSize, x, y, inputChannels, kernelSize, stride, weights.ptr(), numKernels, outX, outY, gradInput.ptr(), weightGrad.ptr(), scale, directWeights, threadColGrads, threadWeightGrads);
+                return;
+            }
 
-            // gradOutput: (rows x numKernels)
-            // localPatch: (rows x cols)
+            // gradOutput: (batch * rows x numKernels)
+            // patches: (batch * rows x patchSize), the bias input is skipped
             // weightGrad: (numKernels x cols)
-            weightGrad.madd(
-                CblasTrans, CblasNoTrans,
-                numKernels, cols, rows,
-                1.0f,
-                goPtr, numKernels,
-                localPatch.data(), cols,
-                (i == 0 ? 0.0f : 1.0f)
-            );
-
-            sgemm(
-                CblasRowMajor, CblasNoTrans, CblasNoTrans,
-                rows, cols, numKernels,
-                1.0f,
-                goPtr, numKernels,
-                weights.ptr(), cols,
-                0.0f,
-                colGrad.data(), cols
-            );
-
-            // Reconstruct the grad input
-            for (usize ox = 0; ox < outX; ox++) {
-                for (usize oy = 0; oy < outY; oy++) {
-                    const usize row = ox * outY + oy;
-                    const float* rowPtr = &colGrad[row * cols];
-                    usize idx = 0;
+            bool weightGradDone = true;
+            if (bf16Gemm) {
+                internal::toBf16(gradOutput.ptr(), halfGrad, gradOutput.size());
+                internal::bf16gemm(
+                    CblasTrans, CblasNoTrans,
+                    numKernels, cols, batchSize * rows,
+                    scale,
+                    halfGrad.data(), numKernels,
+                    halfInput.data(), patchSize(),
+                    1.0f,
+                    weightGrad.ptr(), cols
+                );
+            }
+            else if (cachedSamples == batchSize) {
+                weightGrad.madd(
+                    CblasTrans, CblasNoTrans,
+                    numKernels, cols, batchSize * rows,
+                    scale,
+                    gradOutput.ptr(), numKernels,
+                    patchMatrix.data(), patchSize(),
+                    1.0f
+                );
+            }
+            else
+                weightGradDone = false;
+
+            const bool winograd = usesWinograd();
+
+            if (!weightGradDone || !winograd) {
+                const usize maxThreads = omp_get_max_threads();
+                threadPatches.resize(maxThreads);
+                threadColGrads.resize(maxThreads);
+                threadWeightGrads.resize(maxThreads);
+                if (!weightGradDone)
+                    for (auto& partial : threadWeightGrads)
+                        partial.assign(numKernels * cols, 0.0f);
+
+                #pragma omp parallel
+                {
+                    const usize thread = omp_get_thread_num();
+                    std::vector<float>& patches = threadPatches[thread];
+                    std::vector<float>& colGrad = threadColGrads[thread];
+                    std::vector<float>& partial = threadWeightGrads[thread];
+
+                    if (!weightGradDone)
+                        patches.resize(rows * patchSize());
+                    if (!winograd)
+                        colGrad.resize(rows * cols);
+
+                    #pragma omp for
+                    for (usize i = 0; i < batchSize; i++) {
+                        const float* goPtr = gradOutput.ptr() + i * outputSize;
+
+                        if (!weightGradDone) {
+                            lowerPatches(previous.values, i, patches.data());
+
+                            cblas_sgemm(
+                                CblasRowMajor, CblasTrans, CblasNoTrans,
+                                numKernels, cols, rows,
+                                1.0f,
+                                goPtr, numKernels,
+                                patches.data(), patchSize(),
+                                1.0f,
+                                partial.data(), cols
+                            );
+                        }
 
-                    for (usize ch = 0; ch < inputChannels; ch++) {
-                        for (usize ky = 0; ky < kernelSize; ky++) {
-                            for (usize kx = 0; kx < kernelSize; kx++) {
-                                const usize ix = ox * stride + kx;
-                                const usize iy = oy * stride + ky;
-                                gradInput[i, ix, iy, ch] += rowPtr[idx++];
+                        if (winograd)
+                            continue;
+
+                        // colGrad: (rows x numKernels) * (numKernels x cols)
+                        if (bf16Gemm) {
+                            internal::bf16gemm(
+                                CblasNoTrans, CblasNoTrans,
+                                rows, cols, numKernels,
+                                1.0f,
+                                halfGrad.data() + i * outputSize, numKernels,
+                                halfWeights.data(), patchSize(),
+                                0.0f,
+                                colGrad.data(), cols
+                            );
+                        }
+                        else {
+                            sgemm(
+                                CblasRowMajor, CblasNoTrans, CblasNoTrans,
+                                rows, cols, numKernels,
+                                1.0f,
+                                goPtr, numKernels,
+                                weights.ptr(), cols,
+                                0.0f,
+                                colGrad.data(), cols
+                            );
+                        }
+
+                        // Reconstruct the grad input
+                        float* image = gradInput.ptr() + i * x * y * inputChannels;
+                        std::fill_n(image, x * y * inputChannels, 0.0f);
+
+                        for (usize ox = 0; ox < outX; ox++) {
+                            for (usize oy = 0; oy < outY; oy++) {
+                                const float* rowPtr = &colGrad[(ox * outY + oy) * cols];
+                                usize idx = 0;
+
+                                for (usize ch = 0; ch < inputChannels; ch++) {
+                                    for (usize ky = 0; ky < kernelSize; ky++) {
+                                        float* inputRow = image + (ox * stride * y + oy * stride + ky) * inputChannels + ch;
+                                        for (usize kx = 0; kx < kernelSize; kx++)
+                                            inputRow[kx * y * inputChannels] += rowPtr[idx++];
+                                    }
+                                }
                             }
                         }
                     }
                 }
+
+                // Partials are summed in thread order so results don't
+                // depend on scheduling
+                if (!weightGradDone)
+                    for (const auto& partial : threadWeightGrads)
+                        cblas_saxpy(weightGrad.size(), scale, partial.data(), 1, weightGrad.ptr(), 1);
             }
-        }
 
-        return { gradInput, weightGrad, biasGrad };
-    }
+            // The input gradient is the gradient of the output zero padded
+            // by 2 and correlated with the rotated kernels
+            if (winograd) {
+                internal::winograd::transformKernels(weights.ptr(), numKernels, inputChannels, true, winogradKernels);
+                internal::winograd::correlate(gradOutput.ptr(), batchSize, outX, outY, numKernels, 2, winogradKernels, inputChannels, x, y, nullptr, gradInput.ptr(), winogradInput, winogradProducts);
+            }
+        }
 
         std::unique_ptr<Layer> clone() override {
             return std::make_unique<Convolution>(*this);
@@ -6,21 +6,35 @@
 #include "../external/stb_image.h"
 
 #include <filesystem>
+#include <algorithm>
+#include <cstring>
 #include <omp.h>
 
-std::vector<float> loadGreyscaleImage(const std::string& path, const Ember::usize w, const Ember::usize h) {
+// Loads an image as greyscale, pixels are scaled
+// to [0, 1] for floats and kept as is for bytes
+template <typename T>
+std::vector<T> loadGreyscaleImage(const std::string& path, const Ember::usize w, const Ember::usize h) {
     int width, height, channels;
     unsigned char* data = stbi_load(path.data(), &width, &height, &channels, 1);
     if (!data)
         throw std::runtime_error("Failed to load image: " + path);
 
-    std::vector<float> vec(width * height);
+    const auto convert = [](const unsigned char pixel) {
+        if constexpr (std::is_same_v<T, float>)
+            return pixel / 255.0f;
+        else
+            return static_cast<T>(pixel);
+    };
+
+    std::vector<T> vec;
 
     if ((w == static_cast<Ember::usize>(width) || w == 0) && (h == static_cast<Ember::usize>(height) || h == 0)) {
+        vec.resize(width * height);
         for (Ember::usize i = 0; i < width * height; i++)
-            vec[i] = data[i] / 255.0f;
+            vec[i] = convert(data[i]);
     }
     else {
+        vec.resize(w * h);
         // Simple nearest-neighbor resize
         for (Ember::usize y = 0; y < h; ++y) {
             for (Ember::usize x = 0; x < w; ++x) {
@@ -28,7 +42,7 @@ std::vector<float> loadGreyscaleImage(const std::string& path, const Ember::usiz
                 const int sourceY = y * height / h;
                 const int sourceIdx = sourceY * width + sourceX;
                 const int destIdx = y * w + x;
-                vec[destIdx] = data[sourceIdx] / 255.0f;
+                vec[destIdx] = convert(data[sourceIdx]);
             }
         }
     }
@@ -37,6 +51,111 @@ std::vector<float> loadGreyscaleImage(const std::string& path, const Ember::usiz
     return vec;
 }
 
+namespace Ember::internal {
+    void DataLoader::setPrefetch(const usize depth, const usize workers) {
+        std::lock_guard lock(mutex);
+        assert(this->workers.empty());
+
+        prefetchDepth = std::max<usize>(depth, 1);
+        numWorkers = std::max<usize>(workers, 1);
+
+        data.resize(prefetchDepth + 1);
+        slotSequence.assign(data.size(), 0);
+        slotReady.assign(data.size(), false);
+
+        // The trainer always holds one slot
+        currBatch = pendingBatch = 0;
+        freeSlots.clear();
+        for (usize slot = 1; slot < data.size(); slot++)
+            freeSlots.push_back(slot);
+
+        nextToLoad = nextToUse = 0;
+    }
+
+    void DataLoader::asyncPreloadBatch() {
+        std::lock_guard lock(mutex);
+        if (threads == 0 || !hasWorkerGuard || !workers.empty())
+            return;
+
+        for (usize i = 0; i < numWorkers; i++)
+            workers.emplace_back(&DataLoader::workerLoop, this);
+    }
+
+    void DataLoader::stopWorkers() {
+        std::vector<std::thread> running;
+        {
+            std::lock_guard lock(mutex);
+            stopping = true;
+            running.swap(workers);
+        }
+        slotFreed.notify_all();
+
+        for (auto& worker : running)
+            worker.join();
+
+        std::lock_guard lock(mutex);
+        stopping = false;
+    }
+
+    void DataLoader::workerLoop() {
+        std::unique_lock lock(mutex);
+        while (true) {
+            slotFreed.wait(lock, [this] { return stopping || !freeSlots.empty(); });
+            if (stopping)
+                return;
+
+            const usize slot = freeSlots.front();
+            freeSlots.pop_front();
+            const u64 sequence = nextToLoad++;
+
+            lock.unlock();
+            loadBatch(slot);
+            lock.lock();
+
+            slotSequence[slot] = sequence;
+            slotReady[slot] = true;
+            batchReady.notify_all();
+        }
+    }
+
+    usize DataLoader::acquireBatch() {
+        std::unique_lock lock(mutex);
+        while (true) {
+            // Batches are handed out in the order they were started
+            for (usize slot = 0; slot < data.size(); slot++) {
+                if (slotReady[slot] && slotSequence[slot] == nextToUse) {
+                    slotReady[slot] = false;
+                    nextToUse++;
+                    return slot;
+                }
+            }
+
+            // Without workers the caller loads the batch itself
+            if (workers.empty() && !freeSlots.empty() && nextToLoad == nextToUse) {
+                const usize slot = freeSlots.front();
+                freeSlots.pop_front();
+                nextToLoad++;
+                nextToUse++;
+
+                lock.unlock();
+                loadBatch(slot);
+                return slot;
+            }
+
+            batchReady.wait(lock);
+        }
+    }
+
+    void DataLoader::releaseBatch(const usize slot) {
+        {
+            std::lock_guard lock(mutex);
+            freeSlots.push_back(slot);
+        }
+        slotFreed.notify_one();
+        batchReady.notify_all();
+    }
+}
+
 namespace Ember::dataloaders {
     ImageDataLoader::ImageDataLoader(const std::string& dataDir, const u64 batchSize, const u64 threads, const float trainSplit, const usize width, const usize height)
         : DataLoader(batchSize, threads), dataDir(dataDir), trainSplit(trainSplit), width(width), height(height) {
@@ -49,6 +168,10 @@ namespace Ember::dataloaders {
                 types.push_back(entry.path().string());
         }
 
+        // Directory iteration order is unspecified, sorting keeps
+        // the train/test split and image cache layout stable
+        std::ranges::sort(types);
+
         fmt::println("Found {} types", types.size());
 
         samplesPerType.resize(types.size());
@@ -63,6 +186,7 @@ namespace Ember::dataloaders {
                     samplesPerType[typeIdx]++;
                 }
             }
+            std::ranges::sort(allImages[typeIdx]);
         }
 
         this->numTrainSamples = 0;
@@ -90,7 +214,7 @@ namespace Ember::dataloaders {
 
         std::vector<std::vector<internal::DataPoint>> localData(threads);
 
-        #pragma omp parallel for num_threads(std::max<usize>(threads, 1))
+        #pragma omp parallel for num_threads(batchThreads())
         for (usize i = 0; i < batchSize; i++) {
             std::mt19937 rng{ std::random_device{}() + omp_get_thread_num()};
 
@@ -98,44 +222,138 @@ namespace Ember::dataloaders {
             std::uniform_int_distribution<usize> typeDist(0, types.size() - 1);
             const usize typeIdx = typeDist(rng);
 
-            // Randomly pick an image
-            std::uniform_int_distribution<usize> imgDist(0, trainSamplesPerType[typeIdx] - 1);
-            const usize imgIdx = imgDist(rng);
+            // Randomly pick an image of this shard
+            const usize shardImages = (trainSamplesPerType[typeIdx] - shardRank + shardCount - 1) / shardCount;
+            std::uniform_int_distribution<usize> imgDist(0, shardImages - 1);
+            const usize imgIdx = shardRank + imgDist(rng) * shardCount;
 
-            std::vector<float> input = loadGreyscaleImage(allImages[typeIdx][imgIdx], width, height);
-            std::vector<float> target(types.size(), 0);
-            target[typeIdx] = 1;
-
-            std::memcpy(&data[batchIdx].input[i, 0], input.data(), sizeof(float) * input.size());
-            std::memcpy(&data[batchIdx].target[i, 0], target.data(), sizeof(float) * target.size());
+            loadImage(typeIdx, imgIdx, &data[batchIdx].input[i, 0]);
+            data[batchIdx].target[i, typeIdx] = 1;
         }
     }
 
-    void ImageDataLoader::loadTestSet() {
-        data[currBatch].input.resize(numTestSamples, width * height);
-        data[currBatch].target.resize(numTestSamples, types.size());
+    void ImageDataLoader::setShard(const usize rank, const usize count) {
+        for (usize typeIdx = 0; typeIdx < types.size(); typeIdx++)
+            if (trainSamplesPerType[typeIdx] <= rank)
+                exitWithMsg(fmt::format("Type '{}' has too few train images for {} shards", types[typeIdx], count), 1);
+
+        DataLoader::setShard(rank, count);
+    }
+
+    void ImageDataLoader::loadTestBatch(internal::DataPoint& data, const u64 first, const u64 count) const {
+        assert(first + count <= numTestSamples);
+
+        data.input.resize(count, width * height);
+        data.target.resize(count, types.size());
 
-        data[currBatch].input.fill(0.0f);
-        data[currBatch].target.fill(0.0f);
+        data.target.fill(0.0f);
 
         if (types.empty())
             exitWithMsg(fmt::format("No types found in '{}'", dataDir), 1);
 
+        // The test images of each type follow its train images
+        std::vector<std::pair<usize, usize>> images(count);
+
         u64 idx = 0;
+        for (usize typeIdx = 0; typeIdx < types.size() && idx < first + count; typeIdx++) {
+            for (usize imgIdx = trainSamplesPerType[typeIdx]; imgIdx < allImages[typeIdx].size() && idx < first + count; imgIdx++) {
+                if (idx >= first)
+                    images[idx - first] = { typeIdx, imgIdx };
+                idx++;
+            }
+        }
+
+        #pragma omp parallel for num_threads(std::max<usize>(threads, 1))
+        for (usize i = 0; i < count; i++) {
+            const auto [typeIdx, imgIdx] = images[i];
+
+            loadImage(typeIdx, imgIdx, &data.input[i, 0]);
+            data.target[i, typeIdx] = 1.0f;
+        }
+    }
+
+    void ImageDataLoader::cacheImages(const std::string& cachePath) {
+        if (width == 0 || height == 0)
+            exitWithMsg("Caching images requires the width and height to be set", 1);
+
+        const usize pixels = width * height;
+
+        imageOffsets.resize(types.size());
+        u64 numImages = 0;
         for (usize typeIdx = 0; typeIdx < types.size(); typeIdx++) {
-            for (usize imgIdx = trainSamplesPerType[typeIdx]; imgIdx < allImages[typeIdx].size(); imgIdx++) {
-                assert(idx < numTestSamples);
+            imageOffsets[typeIdx] = numImages;
+            numImages += allImages[typeIdx].size();
+        }
 
-                std::vector<float> input = loadGreyscaleImage(allImages[typeIdx][imgIdx], width, height);
-                std::vector<float> target(types.size(), 0.0f);
-                target[typeIdx] = 1.0f;
+        // FNV-1a hash of the image paths so a stale cache is not reused
+        u64 pathHash = 0xcbf29ce484222325;
+        for (const auto& images : allImages)
+            for (const auto& path : images)
+                for (const char c : path)
+                    pathHash = (pathHash ^ static_cast<u8>(c)) * 0x100000001b3;
 
-                std::memcpy(&data[currBatch].input[idx, 0], input.data(), sizeof(float) * input.size());
-                std::memcpy(&data[currBatch].target[idx, 0], target.data(), sizeof(float) * target.size());
+        const ImageCacheHeader header{ IMAGE_CACHE_MAGIC, width, height, numImages, pathHash };
 
-                idx++;
+        if (!cachePath.empty() && std::filesystem::exists(cachePath)) {
+            cacheFile.open(cachePath);
+
+            ImageCacheHeader saved{};
+            if (cacheFile.size >= sizeof(saved))
+                std::memcpy(&saved, cacheFile.data, sizeof(saved));
+
+            if (std::memcmp(&saved, &header, sizeof(header)) == 0 && cacheFile.size == sizeof(header) + numImages * pixels) {
+                fmt::println("Using image cache '{}'", cachePath);
+                cache = cacheFile.data + sizeof(header);
+                return;
             }
+
+            cacheFile.close();
+        }
+
+        fmt::println("Decoding {} images into the cache", numImages);
+
+        std::vector<u8> decoded(numImages * pixels);
+
+        #pragma omp parallel for num_threads(std::max<usize>(threads, 1)) schedule(dynamic, 64)
+        for (u64 image = 0; image < numImages; image++) {
+            const usize typeIdx = std::ranges::upper_bound(imageOffsets, image) - imageOffsets.begin() - 1;
+            const auto pixelData = loadGreyscaleImage<u8>(allImages[typeIdx][image - imageOffsets[typeIdx]], width, height);
+            std::memcpy(decoded.data() + image * pixels, pixelData.data(), pixels);
+        }
+
+        if (cachePath.empty()) {
+            memoryCache = std::move(decoded);
+            cache = memoryCache.data();
+            return;
         }
+
+        std::ofstream file(cachePath, std::ios::binary);
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(reinterpret_cast<const char*>(decoded.data()), decoded.size());
+        file.close();
+
+        if (!file) {
+            fmt::println("Could not write image cache to '{}', keeping it in memory", cachePath);
+            memoryCache = std::move(decoded);
+            cache = memoryCache.data();
+            return;
+        }
+
+        cacheFile.open(cachePath);
+        cache = cacheFile.data + sizeof(header);
+    }
+
+    void ImageDataLoader::loadImage(const usize typeIdx, const usize imgIdx, float* out) const {
+        if (cache == nullptr) {
+            const auto input = loadGreyscaleImage<float>(allImages[typeIdx][imgIdx], width, height);
+            std::memcpy(out, input.data(), sizeof(float) * input.size());
+            return;
+        }
+
+        const usize pixels = width * height;
+        const u8* image = cache + (imageOffsets[typeIdx] + imgIdx) * pixels;
+        for (usize i = 0; i < pixels; i++)
+            out[i] = image[i] / 255.0f;
     }
 
     u64 ImageDataLoader::countCorrect(const Tensor& output, const Tensor& target) {
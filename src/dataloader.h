@@ -2,51 +2,125 @@
 
 #include "types.h"
 #include "tensor.h"
+#include "mappedfile.h"
+#include "lineindex.h"
+#include "shufflebuffer.h"
+#include "chess/board.h"
 
+#include <condition_variable>
+#include <algorithm>
 #include <fstream>
 #include <vector>
-#include <future>
+#include <thread>
 #include <random>
-#include <array>
+#include <mutex>
+#include <deque>
 
 
 namespace Ember {
     namespace internal {
         struct DataPoint {
             Tensor input;
+            // Filled instead of input by loaders emitting active feature indices
+            SparseTensor sparseInput;
             Tensor target;
 
             DataPoint() = default;
+
+            bool isSparse() const { return sparseInput.batchSize > 0; }
+
+            // Copies rows [first, first + count) of another data point
+            void copyRows(const DataPoint& other, const usize first, const usize count) {
+                if (other.isSparse()) {
+                    const SparseTensor& features = other.sparseInput;
+                    sparseInput.resize(count, features.numFeatures, features.maxActive);
+                    std::copy_n(features.sample(first), count * features.maxActive, sparseInput.sample(0));
+                }
+                else {
+                    const usize inputSize = other.input.dim(1);
+                    input.resize(count, inputSize);
+                    std::copy_n(other.input.ptr() + first * inputSize, count * inputSize, input.ptr());
+                }
+
+                const usize targetSize = other.target.dim(1);
+                target.resize(count, targetSize);
+                std::copy_n(other.target.ptr() + first * targetSize, count * targetSize, target.ptr());
+            }
         };
 
+        struct WorkerGuard;
+
         struct DataLoader {
             u64 threads;
             u64 batchSize;
 
             u64 numSamples = 0;
 
+            // Batches decoded ahead of the trainer and the number of
+            // long-lived threads decoding them side by side, one per
+            // loader thread by default up to prefetchDepth
+            usize prefetchDepth = 4;
+            usize numWorkers = 1;
+
+            // Slot held by the trainer
             usize currBatch = 0;
+            usize pendingBatch = 0;
+
+            // prefetchDepth + 1 preallocated batches
+            std::vector<DataPoint> data;
 
-            std::future<void> dataFuture;
-            std::array<DataPoint, 2> data;
+            // Loaders lock this while advancing the state they
+            // pick samples from, everything else in loadBatch
+            // may run concurrently for different slots
+            std::mutex sourceMutex;
 
             DataLoader(const u64 batchSize, const u64 threads) {
                 this->threads = threads;
                 this->batchSize = batchSize;
+                setPrefetch(prefetchDepth, std::clamp<usize>(threads, 1, prefetchDepth));
             }
 
-            // Loads batch into other buffer
+            // Threads each worker decodes its batch with, so
+            // the workers together use the loader's threads
+            usize batchThreads() const { return std::max<usize>(threads / numWorkers, 1); }
+
+            // Loads a batch into the given slot
             virtual void loadBatch(const usize batchIdx) = 0;
-            virtual void loadTestSet() = 0;
 
-            // Attempts to load data asynchronously if threads > 0
-            void asyncPreloadBatch() {
-                dataFuture = std::async(threads > 0 ? std::launch::async : std::launch::deferred, [this]() { loadBatch(currBatch ^ 1); });
+            // Number of samples in the test set
+            virtual u64 testSize() const = 0;
+            // Loads test samples [first, first + count) into the given
+            // data point, may be called from several threads at once
+            virtual void loadTestBatch(DataPoint& data, const u64 first, const u64 count) const = 0;
+
+            // Training batches only come from shard rank of count
+            // disjoint shards, test sets are not split
+            usize shardRank = 0;
+            usize shardCount = 1;
+
+            virtual void setShard(const usize rank, const usize count) {
+                shardRank = rank;
+                shardCount = count;
             }
 
+            // Sets how many batches are loaded ahead and by how many
+            // threads, must be called before loading starts
+            void setPrefetch(const usize depth, const usize workers);
+
+            // Starts the loader workers if threads > 0 and the loader has
+            // a WorkerGuard, otherwise batches are loaded on demand by
+            // the trainer
+            void asyncPreloadBatch();
+            void stopWorkers();
+
+            // Blocks until the next batch is loaded and returns its slot
+            // Safe to call from several trainer threads
+            usize acquireBatch();
+            // Hands a slot back to the workers to be refilled
+            void releaseBatch(const usize slot);
+
             void waitForBatch() {
-                if (dataFuture.valid())
-                    dataFuture.get();
+                pendingBatch = acquireBatch();
             }
 
             const DataPoint& batchData() const {
@@ -54,18 +128,61 @@ namespace Ember {
             }
 
             virtual void swapBuffers() {
-                currBatch ^= 1;
+                releaseBatch(currBatch);
+                currBatch = pendingBatch;
             }
 
             // Returns the number of "correct" outputs
             // from the network
             virtual u64 countCorrect(const Tensor& output, const Tensor& target) = 0;
 
-            virtual ~DataLoader() = default;
+            virtual ~DataLoader() { stopWorkers(); }
+
+           private:
+            friend WorkerGuard;
+            bool hasWorkerGuard = false;
+
+            std::vector<std::thread> workers;
+            std::mutex mutex;
+            std::condition_variable slotFreed;
+            std::condition_variable batchReady;
+
+            std::deque<usize> freeSlots;
+            std::vector<u64> slotSequence;
+            std::vector<bool> slotReady;
+            u64 nextToLoad = 0;
+            u64 nextToUse = 0;
+            bool stopping = false;
+
+            void workerLoop();
+        };
+
+        // Declared as the last member of a loader, stops the workers
+        // before the members loadBatch uses are destroyed. Loaders
+        // without one never start workers
+        struct WorkerGuard {
+            DataLoader& loader;
+
+            explicit WorkerGuard(DataLoader& loader) : loader(loader) { loader.hasWorkerGuard = true; }
+
+            WorkerGuard(const WorkerGuard&) = delete;
+            WorkerGuard& operator=(const WorkerGuard&) = delete;
+
+            ~WorkerGuard() { loader.stopWorkers(); }
         };
     }
 
     namespace dataloaders {
+        constexpr u64 IMAGE_CACHE_MAGIC = 0x31454843414D49; // "IMACHE1"
+
+        struct ImageCacheHeader {
+            u64 magic;
+            u64 width;
+            u64 height;
+            u64 numImages;
+            u64 pathHash;
+        };
+
         struct ImageDataLoader : internal::DataLoader {
             std::string dataDir;
             std::vector<std::string> types;
@@ -81,36 +198,114 @@ namespace Ember {
             usize width;
             usize height;
 
+            // Decoded greyscale images, one width x height row per image
+            // ordered by type, null when images are decoded on demand
+            const u8* cache = nullptr;
+            std::vector<u8> memoryCache;
+            internal::MappedFile cacheFile;
+            std::vector<u64> imageOffsets;
+
             ImageDataLoader(const std::string& dataDir, const u64 batchSize, const u64 threads, const float trainSplit, const usize width = 0, const usize height = 0);
 
+            // Decode every image once and build batches from the cache
+            // The cache is kept in memory, or if a path is given it is
+            // saved there and memory mapped by later runs
+            void cacheImages(const std::string& cachePath = "");
+
+            // Writes an image as width * height floats
+            void loadImage(const usize typeIdx, const usize imgIdx, float* out) const;
+
             void loadBatch(const usize batchIdx) override;
-            void loadTestSet() override;
+            void setShard(const usize rank, const usize count) override;
+
+            u64 testSize() const override { return numTestSamples; }
+            void loadTestBatch(internal::DataPoint& data, const u64 first, const u64 count) const override;
 
             u64 countCorrect(const Tensor& output, const Tensor& target) override;
+
+            // Must stay the last member
+            internal::WorkerGuard workerGuard{ *this };
         };
 
         // Defined in ./chess/*
         namespace chess {
+            // Number of positions the chess loaders shuffle together by default,
+            // two buffers of this size are held while the next one fills
+            constexpr u64 DEFAULT_SHUFFLE_BUFFER = 1 << 22;
+
             struct BulletTextDataLoader : internal::DataLoader {
                 std::string filePath;
 
                 u64 batchNumber = 0;
                 usize evalScale = 0;
 
-                std::ifstream file;
+                // Emit active feature indices instead of dense inputs
+                bool sparseInputs;
+
+                internal::MappedFile mappedFile;
+                internal::LineIndex lineIndex;
+
+                // Positions parsed from chunks of the mapped file
+                internal::ShuffleBuffer<Ember::chess::PackedBoard> shuffleBuffer;
+
+                // The first batchSize positions, used as the test set
+                std::vector<Ember::chess::PackedBoard> testPositions;
 
-                BulletTextDataLoader(const std::string& filePath, const u64 batchSize, const usize evalScale, const u64 threads = 0);
+                BulletTextDataLoader(const std::string& filePath, const u64 batchSize, const usize evalScale, const u64 threads = 0, const bool sparseInputs = false, const u64 shuffleBufferSize = DEFAULT_SHUFFLE_BUFFER);
 
                 void loadBatch(const usize batchIdx) override;
-                void loadTestSet() override;
+
+                void setShard(const usize rank, const usize count) override {
+                    DataLoader::setShard(rank, count);
+                    shuffleBuffer.setShard(rank, count);
+                }
+
+                u64 testSize() const override { return batchSize; }
+                void loadTestBatch(internal::DataPoint& data, const u64 first, const u64 count) const override;
 
                 u64 countCorrect(const Tensor& output, const Tensor& target) override;
 
 
                 void swapBuffers() override {
                     batchNumber++;
-                    currBatch ^= 1;
+                    DataLoader::swapBuffers();
+                }
+
+                // Must stay the last member
+                internal::WorkerGuard workerGuard{ *this };
+            };
+
+            // Reads files of packed 32 byte position records
+            // produced from Bullet text files
+            struct BulletBinaryDataLoader : internal::DataLoader {
+                std::string filePath;
+
+                usize evalScale = 0;
+
+                // Emit active feature indices instead of dense inputs
+                bool sparseInputs;
+
+                internal::MappedFile file;
+
+                // Positions copied from chunks of the file
+                internal::ShuffleBuffer<Ember::chess::PackedBoard> shuffleBuffer;
+
+                BulletBinaryDataLoader(const std::string& filePath, const u64 batchSize, const usize evalScale, const u64 threads = 0, const bool sparseInputs = false, const u64 shuffleBufferSize = DEFAULT_SHUFFLE_BUFFER);
+
+                void loadBatch(const usize batchIdx) override;
+
+                void setShard(const usize rank, const usize count) override {
+                    DataLoader::setShard(rank, count);
+                    shuffleBuffer.setShard(rank, count);
                 }
+
+                u64 testSize() const override { return batchSize; }
+                void loadTestBatch(internal::DataPoint& data, const u64 first, const u64 count) const override;
+
+                u64 countCorrect(const Tensor& output, const Tensor& target) override;
+
+                // Must stay the last member
+                internal::WorkerGuard workerGuard{ *this };
             };
         }
     }
@@ -0,0 +1,206 @@
+#pragma once
+
+#include "types.h"
+
+#include <omp.h>
+#include <algorithm>
+#include <vector>
+
+// Direct convolution kernels for layers with small patches on
+// (batch, x, y, channels) tensors. Outputs are accumulated in
+// registers, a block of output channels of a few pixels at a time,
+// without lowering the input to patches
+namespace Ember::internal::direct {
+    // Output channels of a register block, kernels are padded to a
+    // multiple of this with zeros
+    constexpr usize BLOCK = 16;
+    // Neighbouring output pixels sharing each kernel load
+    constexpr usize PIXELS = 4;
+    // Patch entries of a weight gradient block
+    constexpr usize ENTRIES = 4;
+
+    inline usize padded(const usize channels) { return (channels + BLOCK - 1) / BLOCK * BLOCK; }
+
+    // Offset of each patch entry kernel[i][b][a] from the input
+    // pixel at the origin of the patch
+    inline std::vector<usize> patchOffsets(const usize inY, const usize inChannels, const usize kernelSize) {
+        std::vector<usize> offsets;
+        offsets.reserve(kernelSize * kernelSize * inChannels);
+
+        for (usize i = 0; i < inChannels; i++)
+            for (usize b = 0; b < kernelSize; b++)
+                for (usize a = 0; a < kernelSize; a++)
+                    offsets.push_back((a * inY + b) * inChannels + i);
+
+        return offsets;
+    }
+
+    // Transposes weights[o][c] into out[c][o] with rows padded to
+    // padded(outChannels), so each input value meets contiguous kernels
+    inline void transposeKernels(const float* weights, const usize outChannels, const usize cols, std::vector<float>& out) {
+        const usize stride = padded(outChannels);
+        out.assign(cols * stride, 0.0f);
+
+        for (usize o = 0; o < outChannels; o++)
+            for (usize c = 0; c < cols; c++)
+                out[c * stride + o] = weights[o * cols + c];
+    }
+
+    // out[n][ox][oy][o] = bias[o] + sum over i, a, b of
+    // in[n][ox * stride + a][oy * stride + b][i] * kernel[o][i][b][a]
+    // with kernels transposed by transposeKernels
+    inline void correlate(const float* in, const usize batchSize, const usize inX, const usize inY, const usize inChannels, const usize kernelSize, const usize stride,
+     const std::vector<float>& kernels, const usize outChannels, const usize outX, const usize outY, const float* bias, float* out) {
+        const usize cols = kernelSize * kernelSize * inChannels;
+        const usize kernelStride = padded(outChannels);
+        const std::vector<usize> offsets = patchOffsets(inY, inChannels, kernelSize);
+
+        #pragma omp parallel for
+        for (usize line = 0; line < batchSize * outX; line++) {
+            const usize n = line / outX;
+            const usize ox = line % outX;
+            const float* origin = in + (n * inX + ox * stride) * inY * inChannels;
+
+            for (usize first = 0; first < outY; first += PIXELS) {
+                // Past the edge the last pixel is repeated and not stored
+                const float* pixels[PIXELS];
+                for (usize p = 0; p < PIXELS; p++)
+                    pixels[p] = origin + std::min(first + p, outY - 1) * stride * inChannels;
+
+                for (usize o0 = 0; o0 < outChannels; o0 += BLOCK) {
+                    float sums[PIXELS][BLOCK] = {};
+
+                    for (usize c = 0; c < cols; c++) {
+                        const float* kernel = &kernels[c * kernelStride + o0];
+                        for (usize p = 0; p < PIXELS; p++) {
+                            const float v = pixels[p][offsets[c]];
+
+                            #pragma omp simd
+                            for (usize j = 0; j < BLOCK; j++)
+                                sums[p][j] += v * kernel[j];
+                        }
+                    }
+
+                    const usize width = std::min(BLOCK, outChannels - o0);
+                    for (usize p = 0; p < PIXELS && first + p < outY; p++) {
+                        float* pixel = out + ((line * outY) + first + p) * outChannels + o0;
+                        for (usize j = 0; j < width; j++)
+                            pixel[j] = sums[p][j] + bias[o0 + j];
+                    }
+                }
+            }
+        }
+    }
+
+    // Input gradient of correlate into gradInput, and the weight
+    // gradient scaled and added to weights[o][c] layout weightGrad.
+    // Each thread sums its samples into its own partial, the partials
+    // are reduced in thread order
+    inline void gradients(const float* in, const float* gradOut, const usize batchSize, const usize inX, const usize inY, const usize inChannels, const usize kernelSize, const usize stride,
+     const float* weights, const usize outChannels, const usize outX, const usize outY, float* gradInput, float* weightGrad, const float scale,
+     std::vector<float>& paddedWeights, std::vector<std::vector<float>>& threadGradients, std::vector<std::vector<float>>& partials) {
+        const usize cols = kernelSize * kernelSize * inChannels;
+        const usize weightStride = padded(cols);
+        const usize gradStride = padded(outChannels);
+        const usize rows = outX * outY;
+        const std::vector<usize> offsets = patchOffsets(inY, inChannels, kernelSize);
+
+        // weights[o][c] with rows padded, so a block of patch entries
+        // of the input gradient meets contiguous weights
+        paddedWeights.assign(outChannels * weightStride, 0.0f);
+        for (usize o = 0; o < outChannels; o++)
+            std::copy_n(weights + o * cols, cols, &paddedWeights[o * weightStride]);
+
+        const usize maxThreads = omp_get_max_threads();
+        threadGradients.resize(maxThreads);
+        partials.resize(maxThreads);
+        for (auto& partial : partials)
+            partial.assign(cols * gradStride, 0.0f);
+
+        #pragma omp parallel
+        {
+            const usize thread = omp_get_thread_num();
+            std::vector<float>& grads = threadGradients[thread];
+            float* partial = partials[thread].data();
+
+            grads.assign(rows * gradStride, 0.0f);
+
+            #pragma omp for
+            for (usize n = 0; n < batchSize; n++) {
+                const float* image = in + n * inX * inY * inChannels;
+                const float* sampleGrad = gradOut + n * rows * outChannels;
+                float* gradImage = gradInput + n * inX * inY * inChannels;
+
+                std::fill_n(gradImage, inX * inY * inChannels, 0.0f);
+
+                for (usize ox = 0; ox < outX; ox++) {
+                    for (usize first = 0; first < outY; first += PIXELS) {
+                        const float* pixelGrads[PIXELS];
+                        for (usize p = 0; p < PIXELS; p++)
+                            pixelGrads[p] = sampleGrad + (ox * outY + std::min(first + p, outY - 1)) * outChannels;
+
+                        for (usize c0 = 0; c0 < cols; c0 += BLOCK) {
+                            float sums[PIXELS][BLOCK] = {};
+
+                            for (usize o = 0; o < outChannels; o++) {
+                                const float* kernel = &paddedWeights[o * weightStride + c0];
+                                for (usize p = 0; p < PIXELS; p++) {
+                                    const float g = pixelGrads[p][o];
+
+                                    #pragma omp simd
+                                    for (usize j = 0; j < BLOCK; j++)
+                                        sums[p][j] += g * kernel[j];
+                                }
+                            }
+
+                            const usize width = std::min(BLOCK, cols - c0);
+                            for (usize p = 0; p < PIXELS && first + p < outY; p++) {
+                                float* origin = gradImage + (ox * stride * inY + (first + p) * stride) * inChannels;
+                                for (usize j = 0; j < width; j++)
+                                    origin[offsets[c0 + j]] += sums[p][j];
+                            }
+                        }
+                    }
+                }
+
+                // Output gradients with rows padded like the kernels
+                for (usize row = 0; row < rows; row++)
+                    std::copy_n(sampleGrad + row * outChannels, outChannels, &grads[row * gradStride]);
+
+                for (usize c0 = 0; c0 < cols; c0 += ENTRIES) {
+                    usize entryOffsets[ENTRIES];
+                    for (usize e = 0; e < ENTRIES; e++)
+                        entryOffsets[e] = offsets[std::min(c0 + e, cols - 1)];
+
+                    for (usize o0 = 0; o0 < outChannels; o0 += BLOCK) {
+                        float sums[ENTRIES][BLOCK] = {};
+
+                        for (usize ox = 0; ox < outX; ox++) {
+                            for (usize oy = 0; oy < outY; oy++) {
+                                const float* origin = image + (ox * stride * inY + oy * stride) * inChannels;
+                                const float* g = &grads[(ox * outY + oy) * gradStride + o0];
+
+                                for (usize e = 0; e < ENTRIES; e++) {
+                                    const float v = origin[entryOffsets[e]];
+
+                                    #pragma omp simd
+                                    for (usize j = 0; j < BLOCK; j++)
+                                        sums[e][j] += v * g[j];
+                                }
+                            }
+                        }
+
+                        for (usize e = 0; e < ENTRIES && c0 + e < cols; e++)
+                            for (usize j = 0; j < BLOCK; j++)
+                                partial[(c0 + e) * gradStride + o0 + j] += sums[e][j];
+                    }
+                }
+            }
+        }
+
+        for (const auto& partial : partials)
+            for (usize o = 0; o < outChannels; o++)
+                for (usize c = 0; c < cols; c++)
+                    weightGrad[o * cols + c] += scale * partial[c * gradStride + o];
+    }
+}
@@ -1,7 +1,9 @@
 #pragma once
 
 #include "tensor.h"
+#include "bf16.h"
 
+#include <omp.h>
 #include <utility>
 #include <string>
 #include <thread>
@@ -28,6 +30,10 @@ namespace Ember {
 
             virtual void forward(const Layer& previous) = 0;
 
+            // True if the values are the previous layer's values reshaped
+            // so the memory planner can give both the same memory
+            virtual bool aliasesInput() const { return false; }
+
             virtual std::unique_ptr<Layer> clone() = 0;
 
             virtual std::string str() const = 0;
@@ -50,6 +56,16 @@ namespace Ember {
             Tensor weights;  // previousSize rows and size cols, dimensionality of 2
             Tensor biases;   // Dimensionality of 1
 
+            // Run matrix products on bf16 copies of the weights, inputs and
+            // gradients with fp32 accumulation. Only the GEMM operands are
+            // bf16, activations between layers and the weights updated by
+            // the optimizer stay fp32
+            bool bf16Gemm = false;
+            // Working copies made by the last forward pass
+            std::vector<u16> halfWeights;
+            std::vector<u16> halfInput;
+            mutable std::vector<u16> halfGrad;
+
             ComputeLayer() = delete;
 
             explicit ComputeLayer(const usize size) : Layer(size) {
@@ -60,11 +76,15 @@ namespace Ember {
                 this->weights.resize(values.size(), previous.size());
             }
 
-            virtual std::tuple<Tensor, Tensor, Tensor> backward(const Layer& previous, const Tensor& gradOutput) const = 0;
+            // Writes the gradient of the input to gradInput and adds the
+            // weight and bias gradients multiplied by scale to weightGrad
+            // and biasGrad, buffers are resized only if they are too small
+            virtual void backward(const Layer& previous, const Tensor& gradOutput, Tensor& gradInput, Tensor& weightGrad, Tensor& biasGrad, const float scale) const = 0;
         };
 
         struct NonComputeLayer : Layer {
-            virtual Tensor backward(const Layer& previous, const Tensor& gradOutput) const = 0;
+            // Writes the gradient of the input to gradInput
+            virtual void backward(const Layer& previous, const Tensor& gradOutput, Tensor& gradInput) const = 0;
 
             u64 numParams() const override { return 0; }
         };
@@ -90,6 +110,32 @@ namespace Ember {
             u64 numParams() const override { return 0; }
         };
 
+        // Input layer for binary features given as active feature indices
+        // The dense values are never filled, they only describe the shape
+        struct SparseInput : internal::Layer {
+            SparseTensor features;
+
+            SparseInput(const usize numFeatures, const usize maxActive) : Layer(numFeatures) {
+                features.resize(1, numFeatures, maxActive);
+            }
+
+            void setBatchSize(const usize batchSize) override {
+                features.resize(batchSize, features.numFeatures, features.maxActive);
+            }
+
+            void forward([[maybe_unused]] const Layer& previous) override {}
+
+            std::unique_ptr<Layer> clone() override {
+                return std::make_unique<SparseInput>(*this);
+            }
+
+            std::string str() const override {
+                return fmt::format("Sparse input - {} features with up to {} active", features.numFeatures, features.maxActive);
+            }
+
+            u64 numParams() const override { return 0; }
+        };
+
         struct Flatten : internal::NonComputeLayer {
             std::vector<usize> originalDimensions;
 
@@ -103,12 +149,18 @@ namespace Ember {
                 originalDimensions[0] = batchSize;
             }
 
-            void forward(const Layer& previous) override { values.data = previous.values.data; }
-            Tensor backward([[maybe_unused]] const Layer& previous, const Tensor& gradOutput) const override {
-                Tensor reshapedGrad = gradOutput;
-                reshapedGrad.reshape(originalDimensions);
-                return reshapedGrad;
+            // Nothing is copied when planned memory is shared with the previous layer
+            void forward(const Layer& previous) override {
+                if (values.ptr() != previous.values.ptr())
+                    values.data = previous.values.data;
             }
+            void backward([[maybe_unused]] const Layer& previous, const Tensor& gradOutput, Tensor& gradInput) const override {
+                gradInput.resize(originalDimensions);
+                if (gradInput.ptr() != gradOutput.ptr())
+                    std::memcpy(gradInput.ptr(), gradOutput.ptr(), gradOutput.size() * sizeof(float));
+            }
+
+            bool aliasesInput() const override { return true; }
 
             std::unique_ptr<Layer> clone() override {
                 return std::make_unique<Flatten>(*this);
@@ -132,31 +184,43 @@ namespace Ember {
                 for (usize i = 0; i < batchSize; i++)
                     std::memcpy(&values[i, 0], biases.ptr(), outputSize * sizeof(float));
 
-                values.madd(previous.values, weights, false, true);
+                if (bf16Gemm) {
+                    const usize inputSize = weights.dim(1);
+
+                    internal::toBf16(weights.ptr(), halfWeights, weights.size());
+                    internal::toBf16(previous.values.ptr(), halfInput, previous.values.size());
+
+                    internal::bf16gemm(CblasNoTrans, CblasTrans, batchSize, outputSize, inputSize, 1.0f, halfInput.data(), inputSize, halfWeights.data(), inputSize, 1.0f, values.ptr(), outputSize);
+                }
+                else
+                    values.madd(previous.values, weights, false, true);
             }
 
-            // Returns gradInput, weightGrad, biasGrad
-            std::tuple<Tensor, Tensor, Tensor> backward(const Layer& previous, const Tensor& gradOutput) const override {
+            void backward(const Layer& previous, const Tensor& gradOutput, Tensor& gradInput, Tensor& weightGrad, Tensor& biasGrad, const float scale) const override {
                 const usize batchSize = values.dim(0);
                 const usize inputSize = previous.values.size() / batchSize;
                 const usize outputSize = values.size() / batchSize;
 
-                Tensor gradInput(batchSize, inputSize);
-                Tensor weightGrad(outputSize, inputSize);
-                Tensor biasGrad(outputSize);
+                gradInput.resize(batchSize, inputSize);
+
+                if (bf16Gemm) {
+                    internal::toBf16(gradOutput.ptr(), halfGrad, gradOutput.size());
 
-                // gradInput = (batch x outputSize) * (outputSize x inputSize)
-                gradInput.madd(gradOutput, weights);
+                    internal::bf16gemm(CblasNoTrans, CblasNoTrans, batchSize, inputSize, outputSize, 1.0f, halfGrad.data(), outputSize, halfWeights.data(), inputSize, 0.0f, gradInput.ptr(), inputSize);
+                    internal::bf16gemm(CblasTrans, CblasNoTrans, outputSize, inputSize, batchSize, scale, halfGrad.data(), outputSize, halfInput.data(), inputSize, 1.0f, weightGrad.ptr(), inputSize);
+                }
+                else {
+                    // gradInput = (batch x outputSize) * (outputSize x inputSize)
+                    gradInput.madd(CblasNoTrans, CblasNoTrans, batchSize, inputSize, outputSize, 1.0f, gradOutput.ptr(), outputSize, weights.ptr(), inputSize, 0.0f);
 
-                // weightGrad = (outputSize x batch) * (batch x inputSize)
-                weightGrad.madd(gradOutput, previous.values, true, false);
+                    // weightGrad += scale * (outputSize x batch) * (batch x inputSize)
+                    weightGrad.madd(CblasTrans, CblasNoTrans, outputSize, inputSize, batchSize, scale, gradOutput.ptr(), outputSize, previous.values.ptr(), inputSize, 1.0f);
+                }
 
                 // Sum over batch of gradOutput
                 for (usize i = 0; i < batchSize; i++)
                     for (usize j = 0; j < outputSize; j++)
-                        biasGrad[j] += gradOutput[i, j];
-
-                return { gradInput, weightGrad, biasGrad };
+                        biasGrad[j] += scale * gradOutput[i, j];
             }
 
             std::unique_ptr<Layer> clone() override {
@@ -168,5 +232,86 @@ namespace Ember {
             }
             u64 numParams() const override { return weights.size() + biases.size(); }
         };
+
+        // Linear layer that must directly follow a SparseInput
+        // Weights are stored with one row per input feature so the
+        // weights of an active feature are contiguous
+        struct SparseLinear : internal::ComputeLayer {
+            explicit SparseLinear(const usize size) : ComputeLayer(size) {}
+
+            void init(const Tensor& previous) override {
+                this->weights.resize(previous.size(), values.size());
+            }
+
+            static const SparseTensor& inputFeatures(const Layer& previous) {
+                const auto* input = dynamic_cast<const SparseInput*>(&previous);
+                if (input == nullptr)
+                    exitWithMsg("SparseLinear must directly follow a SparseInput layer", 1);
+                return input->features;
+            }
+
+            // Forward pass
+            // Sums the weight rows of every active feature onto the biases
+            void forward(const Layer& previous) override {
+                const SparseTensor& features = inputFeatures(previous);
+
+                const usize batchSize = values.dim(0);
+                const usize outputSize = values.size() / batchSize;
+
+                #pragma omp parallel for
+                for (usize i = 0; i < batchSize; i++) {
+                    float* out = &values[i, 0];
+                    std::memcpy(out, biases.ptr(), outputSize * sizeof(float));
+
+                    const i32* active = features.sample(i);
+                    for (usize f = 0; f < features.maxActive && active[f] >= 0; f++) {
+                        const float* row = weights.ptr() + active[f] * outputSize;
+                        for (usize j = 0; j < outputSize; j++)
+                            out[j] += row[j];
+                    }
+                }
+            }
+
+            // gradInput is left as is since nothing precedes the input
+            void backward(const Layer& previous, const Tensor& gradOutput, [[maybe_unused]] Tensor& gradInput, Tensor& weightGrad, Tensor& biasGrad, const float scale) const override {
+                const SparseTensor& features = inputFeatures(previous);
+
+                const usize batchSize = values.dim(0);
+                const usize outputSize = values.size() / batchSize;
+
+                // Scatter each sample's gradient into the rows of its active features
+                // Threads own disjoint column ranges so no element is written twice
+                #pragma omp parallel
+                {
+                    const usize numThreads = omp_get_num_threads();
+                    const usize colsPerThread = (outputSize + numThreads - 1) / numThreads;
+                    const usize colStart = std::min(outputSize, omp_get_thread_num() * colsPerThread);
+                    const usize colEnd = std::min(outputSize, colStart + colsPerThread);
+
+                    for (usize i = 0; i < batchSize; i++) {
+                        const float* grad = gradOutput.ptr() + i * outputSize;
+                        const i32* active = features.sample(i);
+                        for (usize f = 0; f < features.maxActive && active[f] >= 0; f++) {
+                            float* row = weightGrad.ptr() + active[f] * outputSize;
+                            for (usize j = colStart; j < colEnd; j++)
+                                row[j] += scale * grad[j];
+                        }
+                    }
+                }
+
+                for (usize i = 0; i < batchSize; i++)
+                    for (usize j = 0; j < outputSize; j++)
+                        biasGrad[j] += scale * gradOutput[i, j];
+            }
+
+            std::unique_ptr<Layer> clone() override {
+                return std::make_unique<SparseLinear>(*this);
+            }
+
+            std::string str() const override {
+                return fmt::format("Sparse linear - {} input features and {} output features", weights.dim(0), values.dim(1));
+            }
+            u64 numParams() const override { return weights.size() + biases.size(); }
+        };
     }
 }
\ No newline at end of file
@@ -3,33 +3,28 @@
 #include "util.h"
 
 #include <algorithm>
+#include <atomic>
+#include <numeric>
 
 namespace Ember {
-    void Learner::backward(const Network& net, const Tensor& target) const {
-        Tensor error = lossFunc->backward(net.output(), target);
-
-        const float batchScalar = 1.0f / net.layers[0]->values.dim(0);
-        for (usize idx = net.layers.size() - 1; idx > 0; idx--) {
-            auto* layer = net.layers[idx].get();
+    void Learner::backward(Network& net, const Tensor& target) const {
+        const float batchScalar = 1.0f / net.output().dim(0);
+        backward(net, target, optimizer.weightGradients, optimizer.biasGradients, batchScalar);
+    }
 
-            if (const auto* actLayer = dynamic_cast<internal::NonComputeLayer*>(layer)) {
-                error = actLayer->backward(*net.layers[idx - 1], error);
-            }
-            else if (const auto* compLayer = dynamic_cast<internal::ComputeLayer*>(layer)) {
-                auto [gradInput, weightGrad, biasGrad] = compLayer->backward(*net.layers[idx - 1], error);
+    void Learner::backward(Network& net, const Tensor& target, std::vector<Tensor>& weightGrads, std::vector<Tensor>& biasGrads, const float scalar) const {
+        auto& errors = net.errors;
+        errors.resize(net.layers.size());
 
-                // Weights
-                cblas_saxpy(optimizer.weightGradients[idx].size(), batchScalar,
-                            weightGrad.ptr(), 1,
-                            optimizer.weightGradients[idx].ptr(), 1);
+        lossFunc->backward(net.output(), target, errors.back());
 
-                // Biases
-                cblas_saxpy(optimizer.biasGradients[idx].size(), batchScalar,
-                            biasGrad.ptr(), 1,
-                            optimizer.biasGradients[idx].ptr(), 1);
+        for (usize idx = net.layers.size() - 1; idx > 0; idx--) {
+            auto* layer = net.layers[idx].get();
 
-                error = std::move(gradInput);
-            }
+            if (const auto* actLayer = dynamic_cast<internal::NonComputeLayer*>(layer))
+                actLayer->backward(*net.layers[idx - 1], errors[idx], errors[idx - 1]);
+            else if (const auto* compLayer = dynamic_cast<internal::ComputeLayer*>(layer))
+                compLayer->backward(*net.layers[idx - 1], errors[idx], errors[idx - 1], weightGrads[idx], biasGrads[idx], scalar);
         }
     }
 
@@ -47,30 +42,302 @@ namespace Ember {
         std::pair<float, float> test{};
 
         const u64 batchSize = dataLoader.batchSize;
-        const u64 batchesPerEpoch = dataLoader.numSamples / batchSize;
+        // Every process of a group takes the same number of steps
+        const u64 batchesPerEpoch = dataLoader.numSamples / batchSize / (processGroup ? processGroup->worldSize : 1);
 
         ProgressBar progressBar{};
 
         // Returns { test loss, test accuracy }
-        const auto getTestLossAcc = [&]() {
-            dataLoader.loadTestSet();
-            const internal::DataPoint& data = dataLoader.batchData();
-            const usize testSize = data.input.dim(0);
+        // The test set is streamed through in training sized batches,
+        // each thread evaluating on its own replica of the network that
+        // shares its parameters, so memory stays bounded and the training
+        // buffers keep their shape
+        const auto getTestLossAcc = [&](Network& model, const usize maxThreads, const bool inBackground) {
+            const u64 testSize = dataLoader.testSize();
+            const u64 numTestBatches = (testSize + batchSize - 1) / batchSize;
+            // In the background the team always has at least two threads
+            // so it is an active OpenMP region. Nested regions in the
+            // layers and loader then run on the calling thread, as do BLAS
+            // calls with an OpenMP build of OpenBLAS. A pthreads build
+            // keeps one pool for the whole process, which the trainer's
+            // BLAS thread count sizes
+            const usize numThreads = std::clamp<usize>(maxThreads, inBackground ? 2 : 1, std::max<u64>(numTestBatches, inBackground ? 2 : 1));
+
+            std::vector<Network> evalNets(numThreads);
+            for (auto& evalNet : evalNets) {
+                evalNet.shareParams(model);
+                evalNet.planMemory(std::clamp<u64>(testSize, 1, batchSize), NetworkMode::EVAL);
+            }
+            std::vector<internal::DataPoint> evalData(numThreads);
+
+            double loss = 0;
+            u64 numCorrect = 0;
+
+            // Parallelism comes from running batches side by side, in the
+            // background the BLAS thread count belongs to the trainer
+            if (!inBackground)
+                openblas_set_num_threads(1);
+
+            #pragma omp parallel for num_threads(numThreads) schedule(dynamic) reduction(+ : loss, numCorrect)
+            for (u64 b = 0; b < numTestBatches; b++) {
+                const usize thread = omp_get_thread_num();
+                const u64 first = b * batchSize;
+                const u64 count = std::min(batchSize, testSize - first);
+
+                dataLoader.loadTestBatch(evalData[thread], first, count);
+                evalNets[thread].forward(evalData[thread], inBackground ? 0 : 1);
+
+                loss += static_cast<double>(lossFunc->forward(evalNets[thread].output(), evalData[thread].target)) * count;
+                numCorrect += dataLoader.countCorrect(evalNets[thread].output(), evalData[thread].target);
+            }
+
+            const float samples = testSize ? testSize : 1;
+            return std::pair<float, float>{ loss / samples, numCorrect / samples };
+        };
+
+        Stopwatch<std::chrono::milliseconds> stopwatch;
+
+        // Snapshot being evaluated in the background and the
+        // state of the epoch it was taken at
+        std::unique_ptr<Network> evalSnapshot;
+        std::future<std::pair<float, float>> pendingEval;
+        usize evalEpoch = 0;
+        float evalTrainLoss = 0;
+
+        // Hands finished background results to the callbacks as if
+        // their epoch had just ended, returns true if the fit was cancelled
+        const auto deliverEval = [&](const bool wait) {
+            if (!pendingEval.valid())
+                return false;
+            if (!wait && pendingEval.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+                return false;
+
+            std::tie(testLoss, testAccuracy) = pendingEval.get();
+            testedNet = evalSnapshot.get();
+
+            const float currentTrainLoss = trainLoss;
+            const usize currentEpoch = epoch;
+            trainLoss = evalTrainLoss;
+            epoch = evalEpoch;
+
+            bool cancelled = false;
+            try {
+                for (const auto& c : callbacks)
+                    c->run(internal::AFTER_EPOCH);
+            }
+            catch (const internal::CallbackException& e) {
+                if (const auto* error = dynamic_cast<const internal::CancelFitException*>(&e))
+                    cancelled = true;
+            }
 
-            net.forward(data.input, threads);
+            trainLoss = currentTrainLoss;
+            epoch = currentEpoch;
+            // The snapshot is replaced once the next one is taken
+            testedNet = nullptr;
 
-            const float loss = lossFunc->forward(net.output(), data.target);
+            // Replace the progress lines with the result, they are
+            // redrawn below it by the next batch
+            internal::cursor::up();
+            internal::cursor::clear();
+            internal::cursor::up();
+            internal::cursor::clear();
 
-            const u64 numCorrect = dataLoader.countCorrect(net.output(), data.target);
+            fmt::println("{:>5L}{:>14.5f}{:>13.5f}{:>16.2f}%{:>12}\n\n", evalEpoch, evalTrainLoss / batchesPerEpoch, testLoss, testAccuracy * 100, formatTime(stopwatch.elapsed()));
 
-            return std::pair<float, float>{ loss, numCorrect / static_cast<float>(testSize ? testSize : 1) };
+            return cancelled;
         };
 
         // Store the compute layers so RTTI isn't done on-the-fly
         std::vector<internal::ComputeLayer*> computeLayers;
         std::vector<usize> computeLayerIndexes;
 
-        Stopwatch<std::chrono::milliseconds> stopwatch;
+        // Data parallel replicas, replica 0 is net itself and accumulates
+        // straight into the optimizer's gradients. The others view the
+        // parameters of net and accumulate into their own gradients
+        const usize numHogwild = std::max<usize>(hogwildThreads, 1);
+        const usize numReplicas = numHogwild > 1 ? 1 : std::clamp<usize>(replicas, 1, batchSize);
+        std::vector<Network> replicaNets;
+        std::vector<std::vector<Tensor>> replicaWeightGrads;
+        std::vector<std::vector<Tensor>> replicaBiasGrads;
+        std::vector<internal::DataPoint> shards(numReplicas);
+
+        const auto replicaNet = [&](const usize r) -> Network& { return r == 0 ? net : replicaNets[r - 1]; };
+        const auto replicaWeightGrad = [&](const usize r) -> std::vector<Tensor>& { return r == 0 ? optimizer.weightGradients : replicaWeightGrads[r - 1]; };
+        const auto replicaBiasGrad = [&](const usize r) -> std::vector<Tensor>& { return r == 0 ? optimizer.biasGradients : replicaBiasGrads[r - 1]; };
+
+        // Splits the batch across the replicas, runs them side by side and
+        // sums their gradients into the optimizer. Gradients and the loss
+        // returned are scaled as part of a batch of total samples
+        const auto dataParallelBatch = [&](const internal::DataPoint& batch, const usize total) {
+            const usize size = batch.target.dim(0);
+
+            std::vector<float> losses(numReplicas);
+
+            // Parallelism comes from the replicas
+            openblas_set_num_threads(1);
+
+            #pragma omp parallel for num_threads(numReplicas)
+            for (usize r = 0; r < numReplicas; r++) {
+                // The first size % numReplicas shards take one extra sample
+                const usize shardSize = size / numReplicas + (r < size % numReplicas);
+                const usize first = r * (size / numReplicas) + std::min(r, size % numReplicas);
+
+                shards[r].copyRows(batch, first, shardSize);
+
+                Network& model = replicaNet(r);
+                model.forward(shards[r], 0);
+
+                losses[r] = lossFunc->forward(model.output(), shards[r].target) * shardSize / total;
+
+                // Loss gradients are averaged over the shard so
+                // they are rescaled to be averaged over the batch
+                backward(model, shards[r].target, replicaWeightGrad(r), replicaBiasGrad(r), static_cast<float>(shardSize) / (total * total));
+            }
+
+            // Tree reduction of the gradients into replica 0
+            for (usize stride = 1; stride < numReplicas; stride *= 2) {
+                #pragma omp parallel for num_threads(numReplicas) schedule(dynamic)
+                for (usize r = 0; r < numReplicas - stride; r += 2 * stride) {
+                    for (const usize idx : computeLayerIndexes) {
+                        cblas_saxpy(replicaWeightGrad(r)[idx].size(), 1.0f, replicaWeightGrad(r + stride)[idx].ptr(), 1, replicaWeightGrad(r)[idx].ptr(), 1);
+                        cblas_saxpy(replicaBiasGrad(r)[idx].size(), 1.0f, replicaBiasGrad(r + stride)[idx].ptr(), 1, replicaBiasGrad(r)[idx].ptr(), 1);
+                    }
+                }
+            }
+
+            #pragma omp parallel for num_threads(numReplicas)
+            for (usize r = 1; r < numReplicas; r++) {
+                for (const usize idx : computeLayerIndexes) {
+                    replicaWeightGrad(r)[idx].fill(0);
+                    replicaBiasGrad(r)[idx].fill(0);
+                }
+            }
+
+            float loss = 0;
+            for (const float l : losses)
+                loss += l;
+            return loss;
+        };
+
+        // Forward and backward passes of part of a batch of total samples,
+        // adds its gradients to the optimizer and returns its share of the loss
+        const auto accumulateGradients = [&](const internal::DataPoint& batch, const usize total) {
+            float loss;
+            if (numReplicas > 1)
+                loss = dataParallelBatch(batch, total);
+            else {
+                const usize size = batch.target.dim(0);
+
+                net.forward(batch, threads);
+                loss = lossFunc->forward(net.output(), batch.target) * (static_cast<float>(size) / total);
+
+                backward(net, batch.target, optimizer.weightGradients, optimizer.biasGradients, static_cast<float>(size) / (total * total));
+            }
+
+            // Inputs are overwritten by the next part of the batch
+            for (usize r = 0; r < numReplicas; r++)
+                optimizer.markTouched(replicaNet(r));
+
+            return loss;
+        };
+
+        const usize numMicroBatches = std::clamp<usize>(microBatches, 1, batchSize);
+        internal::DataPoint microBatch;
+
+        // Hogwild state, thread 0 trains net itself and the other threads
+        // train copies whose weights view the weights of net
+        std::vector<Network> hogwildNets;
+        std::vector<std::vector<Tensor>> hogwildWeightGrads;
+        std::vector<std::vector<Tensor>> hogwildBiasGrads;
+        // Weight rows each thread updates, for sparse layers
+        // only the rows of the features active in its batch
+        std::vector<std::vector<std::vector<usize>>> hogwildRows;
+        std::vector<usize> sparseLayerIndexes;
+
+        // Trains an epoch with every thread running its own batches and
+        // applying its updates straight to the shared weights
+        const auto hogwildEpoch = [&]() {
+            std::atomic<u64> nextBatch = 0;
+            std::atomic<u64> batchesDone = 0;
+
+            // Parallelism comes from the threads
+            openblas_set_num_threads(1);
+
+            #pragma omp parallel num_threads(numHogwild)
+            {
+                const usize thread = omp_get_thread_num();
+                Network& model = thread == 0 ? net : hogwildNets[thread - 1];
+                std::vector<Tensor>& weightGrads = hogwildWeightGrads[thread];
+                std::vector<Tensor>& biasGrads = hogwildBiasGrads[thread];
+                std::vector<std::vector<usize>>& rows = hogwildRows[thread];
+
+                std::vector<std::vector<bool>> touched(net.layers.size());
+                for (const usize idx : sparseLayerIndexes)
+                    touched[idx].resize(weightGrads[idx].dim(0));
+
+                while (nextBatch.fetch_add(1, std::memory_order_relaxed) < batchesPerEpoch) {
+                    const usize slot = dataLoader.acquireBatch();
+                    const internal::DataPoint& batch = dataLoader.data[slot];
+
+                    model.forward(batch, 0);
+                    const float loss = lossFunc->forward(model.output(), batch.target);
+                    backward(model, batch.target, weightGrads, biasGrads, 1.0f / batch.target.dim(0));
+
+                    dataLoader.releaseBatch(slot);
+
+                    // Sparse layers only have gradients in the rows of active features
+                    for (const usize idx : sparseLayerIndexes) {
+                        const auto& features = static_cast<const layers::SparseInput*>(model.layers[idx - 1].get())->features;
+
+                        rows[idx].clear();
+                        for (const i32 feature : features.indices) {
+                            if (feature >= 0 && !touched[idx][feature]) {
+                                touched[idx][feature] = true;
+                                rows[idx].push_back(feature);
+                            }
+                        }
+                    }
+
+                    // Clip to a norm of 1 like the synchronous step
+                    double normSq = 0;
+                    for (const usize idx : computeLayerIndexes) {
+                        const usize rowSize = weightGrads[idx].size() / weightGrads[idx].dim(0);
+                        for (const usize row : rows[idx])
+                            for (usize i = row * rowSize; i < (row + 1) * rowSize; i++)
+                                normSq += weightGrads[idx].data[i] * weightGrads[idx].data[i];
+                        for (const float g : biasGrads[idx])
+                            normSq += g * g;
+                    }
+                    const float norm = std::sqrt(normSq);
+                    const float gradScale = norm > 1 ? 1 / norm : 1;
+
+                    optimizer.asyncStep(lr, gradScale, weightGrads, biasGrads, rows);
+
+                    for (const usize idx : computeLayerIndexes) {
+                        const usize rowSize = weightGrads[idx].size() / weightGrads[idx].dim(0);
+                        for (const usize row : rows[idx])
+                            std::fill_n(weightGrads[idx].ptr() + row * rowSize, rowSize, 0.0f);
+                        biasGrads[idx].fill(0);
+                    }
+                    for (const usize idx : sparseLayerIndexes)
+                        for (const usize row : rows[idx])
+                            touched[idx][row] = false;
+
+                    std::atomic_ref(trainLoss).fetch_add(loss, std::memory_order_relaxed);
+                    const u64 done = batchesDone.fetch_add(1, std::memory_order_relaxed) + 1;
+
+                    if (thread == 0) {
+                        internal::cursor::up();
+                        internal::cursor::up();
+                        internal::cursor::begin();
+                        fmt::print("{:>5L}{:>14.5f}{:>13}{:>17}{:>12}\n", epoch, std::atomic_ref(trainLoss).load(std::memory_order_relaxed) / done, "Pending", "Pending", formatTime(stopwatch.elapsed()));
+                        std::cout << progressBar.report(done, batchesPerEpoch, 63) << "      " << std::endl;
+                    }
+                }
+            }
+
+            currentBatch = batchesPerEpoch;
+        };
 
         for (const auto& c : callbacks)
             c->setLearner(this);
@@ -95,6 +362,60 @@ namespace Ember {
             }
         }
 
+        // Share the layer memory of net, sized for the largest part of
+        // a batch it runs at once, replicas are planned the same way
+        if (numHogwild > 1)
+            net.planMemory(batchSize);
+        else {
+            const usize microBatchSize = (batchSize + numMicroBatches - 1) / numMicroBatches;
+            net.planMemory((microBatchSize + numReplicas - 1) / numReplicas);
+        }
+
+        if (numHogwild > 1) {
+            hogwildNets.resize(numHogwild - 1);
+            for (auto& replica : hogwildNets) {
+                replica.shareParams(net);
+                replica.planMemory(batchSize);
+            }
+
+            hogwildWeightGrads.assign(numHogwild, optimizer.weightGradients);
+            hogwildBiasGrads.assign(numHogwild, optimizer.biasGradients);
+
+            std::vector<std::vector<usize>> allRows(net.layers.size());
+            for (const usize idx : computeLayerIndexes) {
+                if (dynamic_cast<layers::SparseLinear*>(net.layers[idx].get())) {
+                    sparseLayerIndexes.push_back(idx);
+                    continue;
+                }
+
+                allRows[idx].resize(optimizer.weightGradients[idx].dim(0));
+                std::iota(allRows[idx].begin(), allRows[idx].end(), 0);
+            }
+            hogwildRows.assign(numHogwild, allRows);
+
+            // Every thread holds a batch while training on it
+            dataLoader.setPrefetch(std::max(dataLoader.prefetchDepth, numHogwild + 1), dataLoader.numWorkers);
+        }
+
+        // Replicas step with net through views of its parameters,
+        // only their gradients are stored per replica
+        replicaNets.resize(numReplicas - 1);
+        for (auto& replica : replicaNets) {
+            replica.shareParams(net);
+            replica.planMemory(net.plannedBatchSize);
+        }
+        replicaWeightGrads.assign(numReplicas - 1, optimizer.weightGradients);
+        replicaBiasGrads.assign(numReplicas - 1, optimizer.biasGradients);
+
+        // Start every process of the group from the same weights
+        if (processGroup) {
+            if (numHogwild > 1)
+                exitWithMsg("Hogwild training cannot be used with a process group", 1);
+
+            processGroup->broadcast(net);
+            dataLoader.setShard(processGroup->rank, processGroup->worldSize);
+        }
+
         // Preload first batch
         dataLoader.asyncPreloadBatch();
 
@@ -117,6 +438,11 @@ namespace Ember {
 
             progressBar = ProgressBar();
 
+            if (numHogwild > 1) {
+                hogwildEpoch();
+                goto afterBatches;
+            }
+
             for (currentBatch = 0; currentBatch < batchesPerEpoch; currentBatch++) {
                 try {
                     for (const auto& c : callbacks)
@@ -137,14 +463,28 @@ namespace Ember {
                 // Instantly start loading next batch
                 dataLoader.asyncPreloadBatch();
 
-                net.forward(dataLoader.batchData().input, threads);
-                trainLoss += lossFunc->forward(net.output(), dataLoader.batchData().target);
+                if (numMicroBatches > 1) {
+                    const internal::DataPoint& batch = dataLoader.batchData();
+                    const usize size = batch.target.dim(0);
+
+                    // The first size % numMicroBatches micro-batches take one extra sample
+                    for (usize m = 0; m < numMicroBatches; m++) {
+                        const usize microSize = size / numMicroBatches + (m < size % numMicroBatches);
+                        const usize first = m * (size / numMicroBatches) + std::min(m, size % numMicroBatches);
 
-                backward(net, dataLoader.batchData().target);
+                        microBatch.copyRows(batch, first, microSize);
+                        trainLoss += accumulateGradients(microBatch, size);
+                    }
+                }
+                else
+                    trainLoss += accumulateGradients(dataLoader.batchData(), dataLoader.batchData().target.dim(0));
+
+                if (processGroup) {
+                    processGroup->allReduce(optimizer.weightGradients, optimizer.biasGradients);
+                    optimizer.markGradientRows();
+                }
 
-                optimizer.clipGrad(1);
-                optimizer.step(lr);
-                optimizer.zeroGrad();
+                optimizer.fusedStep(lr, 1);
 
                 internal::cursor::up();
                 internal::cursor::up();
@@ -152,11 +492,34 @@ namespace Ember {
                 fmt::print("{:>5L}{:>14.5f}{:>13}{:>17}{:>12}\n", epoch, trainLoss / currentBatch, "Pending", "Pending", formatTime(stopwatch.elapsed()));
                 std::cout << progressBar.report(currentBatch + 1, batchesPerEpoch, 63) << "      " << std::endl;
 
+                if (deliverEval(false))
+                    goto afterFit;
+
                 afterBatch:
                 for (const auto& c : callbacks)
                     c->run(internal::AFTER_BATCH);
             }
-            test = getTestLossAcc();
+
+            afterBatches:
+            // Callbacks and evaluation see fully updated weights
+            optimizer.flush();
+
+            if (backgroundEval) {
+                // Only one snapshot is evaluated at a time
+                if (deliverEval(true))
+                    goto afterFit;
+
+                evalSnapshot = std::make_unique<Network>(net);
+                evalEpoch = epoch;
+                evalTrainLoss = trainLoss;
+                pendingEval = std::async(std::launch::async, getTestLossAcc, std::ref(*evalSnapshot), evalThreads ? evalThreads : std::max<usize>(threads / 4, 1), true);
+
+                // The progress lines stay until the next batch redraws them
+                continue;
+            }
+
+            test = getTestLossAcc(net, threads, false);
+            testedNet = &net;
 
             testLoss = test.first;
             testAccuracy = test.second;
@@ -180,7 +543,14 @@ namespace Ember {
         }
 
         afterFit:
+        // Results of the last snapshot are still reported
+        deliverEval(true);
+
+        dataLoader.stopWorkers();
+
         for (const auto& c : callbacks)
             c->run(internal::AFTER_FIT);
+
+        testedNet = nullptr;
     }
 }
@@ -5,6 +5,9 @@
 #include "optimizer.h"
 #include "callback.h"
 #include "loss.h"
+#include "processgroup.h"
+
+#include <future>
 
 namespace Ember {
     namespace internal {
@@ -40,6 +43,40 @@ namespace Ember {
         float trainLoss{};
         usize epoch{};
 
+        // Network the test results were measured on, either net
+        // or the snapshot of it evaluated in the background. A
+        // snapshot is only set during its AFTER_EPOCH callbacks
+        const Network* testedNet = nullptr;
+
+        // Evaluate a snapshot of the network on another thread while the
+        // next epoch trains, results reach the AFTER_EPOCH callbacks once
+        // they are ready. evalThreads of 0 uses a quarter of the training
+        // threads, background evaluation uses at least 2
+        bool backgroundEval = false;
+        usize evalThreads = 0;
+
+        // Number of network replicas each batch is split across, every
+        // replica runs on its own thread and their gradients are summed
+        // before the optimizer step. 0 or 1 trains on net alone
+        usize replicas = 0;
+
+        // Number of micro-batches each batch is split into, they run one
+        // after another and accumulate their gradients before a single
+        // step so layer buffers only hold batchSize / microBatches
+        // samples. 0 or 1 runs the whole batch at once
+        usize microBatches = 0;
+
+        // Number of threads training asynchronously, each on its own
+        // batches, stepping the shared weights without locks. Suits
+        // sparse input networks where updates rarely overlap, per batch
+        // callbacks are not run and replicas and microBatches are
+        // ignored. 0 or 1 disables
+        usize hogwildThreads = 0;
+
+        // Processes to average gradients with before every step, each
+        // trains on its own shard of the data. Not used by Hogwild
+        ProcessGroup* processGroup = nullptr;
+
         template<typename LossFunction>
         Learner(Network& net, internal::DataLoader& dataLoader, internal::Optimizer& optimizer, const LossFunction&& lossFunc) : net(net), dataLoader(dataLoader), optimizer(optimizer) {
             this->lossFunc = std::make_unique<std::decay_t<LossFunction>>(lossFunc);
@@ -52,7 +89,10 @@ namespace Ember {
         }
 
         // Calculates and applies gradients to the optimizer
-        void backward(const Network& net, const Tensor& target) const;
+        void backward(Network& net, const Tensor& target) const;
+        // Adds the gradients of net scaled by scalar to the given tensors
+        // The errors of every layer are written to net.errors
+        void backward(Network& net, const Tensor& target, std::vector<Tensor>& weightGrads, std::vector<Tensor>& biasGrads, const float scalar) const;
 
         // Apply a gradient to the optimizer
         void applyGradients(const usize batchSize, const std::vector<Tensor>& weightGradAccum, const std::vector<Tensor>& biasGradAccum);
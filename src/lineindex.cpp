@@ -0,0 +1,121 @@
+#include "lineindex.h"
+
+#include "../external/fmt/format.h"
+
+#include <filesystem>
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+
+namespace Ember::internal {
+    constexpr u64 INDEX_MAGIC = 0x31584449524D45; // "EMRIDX1"
+
+    struct IndexHeader {
+        u64 magic;
+        u64 fileSize;
+        i64 modifiedTime;
+        u64 chunkBytes;
+        u64 numLines;
+        u64 numChunks;
+    };
+
+    u64 nextLineStart(const MappedFile& file, const u64 pos) {
+        if (pos >= file.size)
+            return file.size;
+        const void* newline = std::memchr(file.data + pos, '\n', file.size - pos);
+        return newline ? static_cast<const u8*>(newline) - file.data + 1 : file.size;
+    }
+
+    u64 countNewlines(const u8* begin, const u8* end) {
+        u64 count = 0;
+        while (begin < end) {
+            const void* newline = std::memchr(begin, '\n', end - begin);
+            if (!newline)
+                break;
+            begin = static_cast<const u8*>(newline) + 1;
+            count++;
+        }
+        return count;
+    }
+
+    LineIndex LineIndex::open(const std::string& path, const MappedFile& file, const usize threads) {
+        const std::string indexPath = path + ".idx";
+        const u64 fileSize = file.size;
+        const i64 modifiedTime = std::filesystem::last_write_time(path).time_since_epoch().count();
+
+        LineIndex index;
+        if (index.load(indexPath, fileSize, modifiedTime))
+            return index;
+
+        index = build(file, threads);
+        index.save(indexPath, fileSize, modifiedTime);
+        return index;
+    }
+
+    LineIndex LineIndex::build(const MappedFile& file, const usize threads) {
+        LineIndex index;
+
+        const u64 numRanges = (file.size + CHUNK_BYTES - 1) / CHUNK_BYTES;
+        std::vector<u64> starts(numRanges);
+
+        // Move every fixed size range start to the next line start
+        #pragma omp parallel for num_threads(std::max<usize>(threads, 1))
+        for (u64 i = 0; i < numRanges; i++)
+            starts[i] = i == 0 ? 0 : nextLineStart(file, i * CHUNK_BYTES - 1);
+
+        // Lines longer than a chunk can make neighbouring starts coincide
+        starts.erase(std::unique(starts.begin(), starts.end()), starts.end());
+        while (!starts.empty() && starts.back() >= file.size)
+            starts.pop_back();
+
+        index.chunkOffsets = starts;
+        index.chunkOffsets.push_back(file.size);
+        index.chunkLines.resize(starts.size());
+
+        #pragma omp parallel for num_threads(std::max<usize>(threads, 1))
+        for (usize i = 0; i < starts.size(); i++)
+            index.chunkLines[i] = countNewlines(file.data + index.chunkOffsets[i], file.data + index.chunkOffsets[i + 1]);
+
+        // Match getline, which also returns an unterminated last line
+        if (!index.chunkLines.empty() && file.data[file.size - 1] != '\n')
+            index.chunkLines.back()++;
+
+        for (const u64 lines : index.chunkLines)
+            index.numLines += lines;
+
+        return index;
+    }
+
+    bool LineIndex::load(const std::string& indexPath, const u64 fileSize, const i64 modifiedTime) {
+        std::ifstream in(indexPath, std::ios::binary);
+        if (!in)
+            return false;
+
+        IndexHeader header{};
+        in.read(reinterpret_cast<char*>(&header), sizeof(header));
+
+        if (!in || header.magic != INDEX_MAGIC || header.fileSize != fileSize || header.modifiedTime != modifiedTime || header.chunkBytes != CHUNK_BYTES)
+            return false;
+
+        chunkOffsets.resize(header.numChunks + 1);
+        chunkLines.resize(header.numChunks);
+        in.read(reinterpret_cast<char*>(chunkOffsets.data()), chunkOffsets.size() * sizeof(u64));
+        in.read(reinterpret_cast<char*>(chunkLines.data()), chunkLines.size() * sizeof(u64));
+        numLines = header.numLines;
+
+        return static_cast<bool>(in);
+    }
+
+    void LineIndex::save(const std::string& indexPath, const u64 fileSize, const i64 modifiedTime) const {
+        std::ofstream out(indexPath, std::ios::binary);
+        if (!out) {
+            fmt::println("Could not save line index to '{}'", indexPath);
+            return;
+        }
+
+        const IndexHeader header{ INDEX_MAGIC, fileSize, modifiedTime, CHUNK_BYTES, numLines, numChunks() };
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(chunkOffsets.data()), chunkOffsets.size() * sizeof(u64));
+        out.write(reinterpret_cast<const char*>(chunkLines.data()), chunkLines.size() * sizeof(u64));
+    }
+}
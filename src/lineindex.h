@@ -0,0 +1,38 @@
+#pragma once
+
+#include "mappedfile.h"
+
+#include <string>
+#include <vector>
+
+namespace Ember::internal {
+    // Returns the offset just past the next newline at or after pos
+    u64 nextLineStart(const MappedFile& file, const u64 pos);
+
+    // Line count of a text file along with line aligned chunks
+    // so readers can seek to any part of the file
+    // Saved next to the file as <path>.idx and reused while the
+    // file's size and modification time are unchanged
+    struct LineIndex {
+        // Target size of a chunk in bytes
+        static constexpr u64 CHUNK_BYTES = 4 * 1024 * 1024;
+
+        u64 numLines = 0;
+
+        // Byte offset of the first line of every chunk, followed by the file size
+        std::vector<u64> chunkOffsets;
+        // Number of lines starting in every chunk
+        std::vector<u64> chunkLines;
+
+        usize numChunks() const { return chunkLines.size(); }
+
+        // Loads the saved index if it matches the file, otherwise builds and saves it
+        static LineIndex open(const std::string& path, const MappedFile& file, const usize threads);
+
+        // Counts the lines of a mapped file in parallel
+        static LineIndex build(const MappedFile& file, const usize threads);
+
+        bool load(const std::string& indexPath, u64 fileSize, i64 modifiedTime);
+        void save(const std::string& indexPath, u64 fileSize, i64 modifiedTime) const;
+    };
+}
@@ -10,15 +10,13 @@ namespace Ember::loss {
         return loss / output.size();
     }
 
-    Tensor MeanSquaredError::backward(const Tensor& output, const Tensor& target) {
-        Tensor gradient;
+    void MeanSquaredError::backward(const Tensor& output, const Tensor& target, Tensor& gradient) {
         gradient.resize(output.dims());
 
         const float scalar = 2.0f / output.size();
 
         for (usize i = 0; i < output.size(); i++)
-            gradient[i] = (output.data[i] - target.data[i]) * scalar;
-        return gradient;
+            gradient.data[i] = (output.data[i] - target.data[i]) * scalar;
     }
 
 
@@ -33,10 +31,9 @@ namespace Ember::loss {
         return loss / output.size() - offset;
     }
 
-    Tensor SigmoidMSE::backward(const Tensor& output, const Tensor& target) {
+    void SigmoidMSE::backward(const Tensor& output, const Tensor& target, Tensor& gradient) {
         assert(output.size() == target.size());
 
-        Tensor gradient;
         gradient.resize(output.dims());
 
         const float scalar = 2.0f / output.size();
@@ -52,8 +49,6 @@ namespace Ember::loss {
 
             gradient.data[i] = scalar * (fOutput - fTarget) * fprime_out;
         }
-
-        return gradient;
     }
 
 
@@ -70,10 +65,9 @@ namespace Ember::loss {
         return loss / output.size();
     }
 
-    Tensor CrossEntropyLoss::backward(const Tensor& output, const Tensor& target) {
+    void CrossEntropyLoss::backward(const Tensor& output, const Tensor& target, Tensor& gradient) {
         assert(output.size() == target.size());
 
-        Tensor gradient;
         gradient.resize(output.dims());
 
         const float scalar = 1.0f / output.size();
@@ -81,7 +75,5 @@ namespace Ember::loss {
             const float prob = std::max(output.data[i], 1e-10f);
             gradient.data[i] = -target.data[i] / prob * scalar;
         }
-
-        return gradient;
     }
 }
\ No newline at end of file
@@ -7,7 +7,8 @@ namespace Ember {
     namespace internal {
         struct LossFunction {
             virtual float forward(const Tensor& output, const Tensor& target) = 0;
-            virtual Tensor backward(const Tensor& output, const Tensor& target) = 0;
+            // Writes the gradient of the loss with respect to output to gradient
+            virtual void backward(const Tensor& output, const Tensor& target, Tensor& gradient) = 0;
 
             virtual ~LossFunction() = default;
         };
@@ -16,7 +17,7 @@ namespace Ember {
     namespace loss {
         struct MeanSquaredError : internal::LossFunction {
             float forward(const Tensor& output, const Tensor& target) override;
-            Tensor backward(const Tensor& output, const Tensor& target) override;
+            void backward(const Tensor& output, const Tensor& target, Tensor& gradient) override;
         };
 
         // Apply sigmoid to the input and target before
@@ -41,12 +42,12 @@ namespace Ember {
             float sigmoid(const float x) const { return k / (1 + std::exp(a + b * x)); }
 
             float forward(const Tensor& output, const Tensor& target) override;
-            Tensor backward(const Tensor& output, const Tensor& target) override;
+            void backward(const Tensor& output, const Tensor& target, Tensor& gradient) override;
         };
 
         struct CrossEntropyLoss : internal::LossFunction {
             float forward(const Tensor& output, const Tensor& target) override;
-            Tensor backward(const Tensor& output, const Tensor& target) override;
+            void backward(const Tensor& output, const Tensor& target, Tensor& gradient) override;
         };
     }
 }
\ No newline at end of file
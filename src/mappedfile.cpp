@@ -0,0 +1,88 @@
+#include "mappedfile.h"
+
+#include <utility>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace Ember::internal {
+    MappedFile& MappedFile::operator=(MappedFile&& other) noexcept {
+        if (this != &other) {
+            close();
+            data = std::exchange(other.data, nullptr);
+            size = std::exchange(other.size, 0);
+            #ifdef _WIN32
+            file = std::exchange(other.file, INVALID_HANDLE_VALUE);
+            mapping = std::exchange(other.mapping, nullptr);
+            #endif
+        }
+        return *this;
+    }
+
+    void MappedFile::open(const std::string& path) {
+        close();
+
+        #ifdef _WIN32
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+            exitWithMsg("Failed to open file for mapping: " + path, 1);
+
+        LARGE_INTEGER fileSize;
+        GetFileSizeEx(file, &fileSize);
+        size = static_cast<usize>(fileSize.QuadPart);
+        if (size == 0)
+            return;
+
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping == nullptr)
+            exitWithMsg("Failed to map file: " + path, 1);
+
+        data = static_cast<const u8*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+        #else
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            exitWithMsg("Failed to open file for mapping: " + path, 1);
+
+        struct stat info{};
+        fstat(fd, &info);
+        size = static_cast<usize>(info.st_size);
+        if (size == 0) {
+            ::close(fd);
+            return;
+        }
+
+        void* ptr = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (ptr == MAP_FAILED)
+            exitWithMsg("Failed to map file: " + path, 1);
+
+        data = static_cast<const u8*>(ptr);
+        #endif
+
+        if (data == nullptr)
+            exitWithMsg("Failed to map file: " + path, 1);
+    }
+
+    void MappedFile::close() {
+        #ifdef _WIN32
+        if (data)
+            UnmapViewOfFile(data);
+        if (mapping)
+            CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE)
+            CloseHandle(file);
+        mapping = nullptr;
+        file = INVALID_HANDLE_VALUE;
+        #else
+        if (data)
+            munmap(const_cast<u8*>(data), size);
+        #endif
+
+        data = nullptr;
+        size = 0;
+    }
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "types.h"
+
+#include <string>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#endif
+
+namespace Ember::internal {
+    // Read only memory mapping of an entire file
+    struct MappedFile {
+        const u8* data = nullptr;
+        usize size = 0;
+
+        MappedFile() = default;
+        explicit MappedFile(const std::string& path) { open(path); }
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        MappedFile(MappedFile&& other) noexcept { *this = std::move(other); }
+        MappedFile& operator=(MappedFile&& other) noexcept;
+
+        void open(const std::string& path);
+        void close();
+
+        ~MappedFile() { close(); }
+
+       private:
+        #ifdef _WIN32
+        HANDLE file = INVALID_HANDLE_VALUE;
+        HANDLE mapping = nullptr;
+        #endif
+    };
+}
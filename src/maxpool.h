@@ -83,10 +83,11 @@ namespace Ember::layers {
             }
         }
 
-        Tensor backward(const Layer& previous, const Tensor& gradOutput) const override {
+        void backward(const Layer& previous, const Tensor& gradOutput, Tensor& gradInput) const override {
             const usize batchSize = gradOutput.dim(0);
 
-            Tensor gradInput(previous.values.dims());
+            gradInput.resize(previous.values.dims());
+            gradInput.fill(0);
 
             const usize inputXY        = x * y;
             const usize inputXYZ       = x * y * numChannels;
@@ -122,8 +123,6 @@ namespace Ember::layers {
                     }
                 }
             }
-
-            return gradInput;
         }
 
         std::unique_ptr<Layer> clone() override {
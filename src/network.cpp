@@ -6,7 +6,13 @@
 namespace Ember {
     void Network::forward(const Tensor& input, const usize threads) {
         assert(input.dimensionality == 2);
-        openblas_set_num_threads(threads);
+        if (threads > 0) {
+            openblas_set_num_threads(threads);
+            omp_set_num_threads(threads);
+        }
+
+        if (isPlanned() && input.dim(0) > plannedBatchSize)
+            planMemory(input.dim(0), plannedMode);
 
         for (auto& l : layers)
             l->setBatchSize(input.dim(0));
@@ -19,6 +25,244 @@ namespace Ember {
             layers[i]->forward(*layers[i - 1]);
     }
 
+    void Network::forward(const SparseTensor& input, const usize threads) {
+        auto* inputLayer = dynamic_cast<layers::SparseInput*>(layers[0].get());
+        if (inputLayer == nullptr)
+            exitWithMsg("Sparse inputs require the network to start with a SparseInput layer", 1);
+
+        if (threads > 0) {
+            openblas_set_num_threads(threads);
+            omp_set_num_threads(threads);
+        }
+
+        if (isPlanned() && input.batchSize > plannedBatchSize)
+            planMemory(input.batchSize, plannedMode);
+
+        for (auto& l : layers)
+            l->setBatchSize(input.batchSize);
+
+        assert(input.numFeatures == inputLayer->features.numFeatures);
+        assert(input.maxActive == inputLayer->features.maxActive);
+
+        inputLayer->features.indices = input.indices;
+
+        for (usize i = 1; i < layers.size(); i++)
+            layers[i]->forward(*layers[i - 1]);
+    }
+
+    void Network::forward(const internal::DataPoint& data, const usize threads) {
+        if (data.isSparse())
+            forward(data.sparseInput, threads);
+        else
+            forward(data.input, threads);
+    }
+
+    void Network::flattenParams() {
+        if (isFlat())
+            return;
+
+        weightOffsets.assign(layers.size(), 0);
+        biasOffsets.assign(layers.size(), 0);
+
+        usize size = 0;
+        for (usize i = 1; i < layers.size(); i++) {
+            if (const auto* layer = dynamic_cast<internal::ComputeLayer*>(layers[i].get())) {
+                weightOffsets[i] = size;
+                size += internal::alignedSize(layer->weights.size());
+                biasOffsets[i] = size;
+                size += internal::alignedSize(layer->biases.size());
+            }
+        }
+
+        params.assign(size, 0.0f);
+
+        for (usize i = 1; i < layers.size(); i++) {
+            if (auto* layer = dynamic_cast<internal::ComputeLayer*>(layers[i].get())) {
+                std::ranges::copy(layer->weights.data, params.begin() + weightOffsets[i]);
+                std::ranges::copy(layer->biases.data, params.begin() + biasOffsets[i]);
+
+                layer->weights.data.view(params.data() + weightOffsets[i], layer->weights.size());
+                layer->biases.data.view(params.data() + biasOffsets[i], layer->biases.size());
+            }
+        }
+    }
+
+    void Network::shareParams(Network& other) {
+        layers.clear();
+        params.clear();
+        params.shrink_to_fit();
+        weightOffsets.clear();
+        biasOffsets.clear();
+        workspace.clear();
+        workspace.shrink_to_fit();
+        errors.clear();
+        plannedBatchSize = 0;
+
+        // Layers are viewed as they are cloned so only
+        // one layer's parameters are ever copied at a time
+        layers.reserve(other.layers.size());
+        for (const auto& l : other.layers) {
+            layers.push_back(l->clone());
+
+            if (auto* master = dynamic_cast<internal::ComputeLayer*>(l.get())) {
+                auto* layer = static_cast<internal::ComputeLayer*>(layers.back().get());
+
+                layer->weights.data.view(master->weights.ptr(), master->weights.size());
+                layer->biases.data.view(master->biases.ptr(), master->biases.size());
+            }
+        }
+    }
+
+    void Network::planMemory(const usize batchSize, const NetworkMode mode) {
+        const usize numLayers = layers.size();
+        const bool train = mode == NetworkMode::TRAIN;
+
+        // Layers are shaped without allocating so only the
+        // workspace is held once the plan is placed
+        for (auto& l : layers) {
+            l->values.data.detach();
+            l->setBatchSize(batchSize);
+        }
+
+        // Steps layers run at, forward then the loss then backward
+        const usize lossStep = numLayers;
+        const auto backwardStep = [&](const usize idx) { return idx == numLayers ? lossStep : 2 * numLayers - idx; };
+        const usize end = 2 * numLayers;
+
+        // Buffer i is the values of layer i and buffer numLayers + i its
+        // error, layers aliasing their input point at the previous buffer
+        struct Buffer {
+            usize size = 0;
+            usize first = std::numeric_limits<usize>::max();
+            usize last = 0;
+            usize offset = 0;
+            bool used = false;
+        };
+        std::vector<Buffer> buffers(2 * numLayers);
+        std::vector<usize> owner(2 * numLayers);
+
+        const auto use = [&](const usize id, const usize size, const usize first, const usize last) {
+            Buffer& buffer = buffers[owner[id]];
+            buffer.used = true;
+            buffer.size = std::max(buffer.size, size);
+            buffer.first = std::min(buffer.first, first);
+            buffer.last = std::max(buffer.last, last);
+        };
+
+        // Sparse inputs have no dense values to place, and nothing
+        // writes the error of the input then
+        const bool sparseInput = dynamic_cast<const layers::SparseInput*>(layers[0].get()) != nullptr;
+
+        for (usize i = 0; i < numLayers; i++) {
+            owner[i] = i > 0 && layers[i]->aliasesInput() ? owner[i - 1] : i;
+            if (i == 0 && sparseInput)
+                continue;
+
+            // Values are read by the next layer, and in training by
+            // the backward passes of this and the next layer
+            usize last;
+            if (train)
+                last = backwardStep(std::max<usize>(i, 1));
+            else
+                last = i + 1 < numLayers ? i + 1 : end;
+
+            use(i, layers[i]->values.size(), i, last);
+        }
+
+        if (train) {
+            // Errors are written by the backward pass of the next layer
+            // and read by the backward pass of their own
+            for (usize i = numLayers; i-- > 0;) {
+                owner[numLayers + i] = i + 1 < numLayers && layers[i + 1]->aliasesInput() ? owner[numLayers + i + 1] : numLayers + i;
+                if (i == 0 && sparseInput)
+                    continue;
+
+                use(numLayers + i, layers[i]->values.size(), backwardStep(i + 1), backwardStep(std::max<usize>(i, 1)));
+            }
+        }
+
+        // Place the largest buffers first, each at the lowest offset
+        // clear of every placed buffer alive at the same time
+        std::vector<usize> order;
+        for (usize id = 0; id < buffers.size(); id++)
+            if (buffers[id].used)
+                order.push_back(id);
+        std::ranges::stable_sort(order, [&](const usize a, const usize b) { return buffers[a].size > buffers[b].size; });
+
+        std::vector<usize> placed;
+        usize workspaceSize = 0;
+        for (const usize id : order) {
+            Buffer& buffer = buffers[id];
+            const usize size = internal::alignedSize(buffer.size);
+
+            std::vector<std::pair<usize, usize>> taken;
+            for (const usize other : placed)
+                if (buffers[other].first <= buffer.last && buffer.first <= buffers[other].last)
+                    taken.emplace_back(buffers[other].offset, buffers[other].offset + internal::alignedSize(buffers[other].size));
+            std::ranges::sort(taken);
+
+            usize offset = 0;
+            for (const auto& [begin, finish] : taken) {
+                if (offset + size <= begin)
+                    break;
+                offset = std::max(offset, finish);
+            }
+
+            buffer.offset = offset;
+            workspaceSize = std::max(workspaceSize, offset + size);
+            placed.push_back(id);
+        }
+
+        // The previous plan is released first
+        workspace.clear();
+        workspace.shrink_to_fit();
+        workspace.assign(workspaceSize, 0.0f);
+
+        for (usize i = 0; i < numLayers; i++) {
+            const Buffer& buffer = buffers[owner[i]];
+            if (buffer.used)
+                layers[i]->values.data.view(workspace.data() + buffer.offset, layers[i]->values.size());
+            else
+                layers[i]->values.data.own(layers[i]->values.size());
+        }
+
+        errors.clear();
+        errors.resize(numLayers);
+        if (train) {
+            for (usize i = 0; i < numLayers; i++) {
+                const Buffer& buffer = buffers[owner[numLayers + i]];
+                if (!buffer.used)
+                    continue;
+
+                errors[i].data.detach();
+                errors[i].resize(layers[i]->values.dims());
+                errors[i].data.view(workspace.data() + buffer.offset, layers[i]->values.size());
+            }
+        }
+
+        plannedBatchSize = batchSize;
+        plannedMode = mode;
+    }
+
+    bool Network::setBf16Gemm(const bool enabled) {
+        const bool use = enabled && internal::hasBf16Gemm();
+        if (enabled && !use)
+            fmt::println("Warning: this CPU or OpenBLAS build has no native bf16 GEMM, keeping fp32 GEMMs");
+
+        for (auto& l : layers) {
+            if (auto* layer = dynamic_cast<internal::ComputeLayer*>(l.get())) {
+                layer->bf16Gemm = use;
+                if (!use) {
+                    layer->halfWeights = {};
+                    layer->halfInput = {};
+                    layer->halfGrad = {};
+                }
+            }
+        }
+
+        return use;
+    }
+
     const Tensor& Network::output() const {
         return layers.back()->values;
     }
@@ -8,6 +8,7 @@
 namespace Ember {
     namespace internal {
         struct DataLoader;
+        struct DataPoint;
     }
 
     enum class NetworkMode {
@@ -21,6 +22,38 @@ namespace Ember {
     struct Network {
         std::vector<std::unique_ptr<internal::Layer>> layers;
 
+        // Every weight and bias once flattened, each layer's weights then
+        // biases at aligned offsets, with the layer tensors viewing it
+        internal::Arena params;
+        std::vector<usize> weightOffsets;
+        std::vector<usize> biasOffsets;
+
+        // Gradient of the loss with respect to each layer's values,
+        // reused by every backward pass so nothing is allocated per batch
+        std::vector<Tensor> errors;
+
+        bool isFlat() const { return !weightOffsets.empty(); }
+        // Moves the parameters into params, does nothing if already flat
+        void flattenParams();
+        // Replaces the layers with copies of the layers of other whose
+        // weights and biases view those of other, so replicas running
+        // beside it own no parameters. Memory is left unplanned and
+        // other must outlive this network
+        void shareParams(Network& other);
+
+        // Values and errors of every layer once memory is planned
+        internal::Arena workspace;
+        usize plannedBatchSize = 0;
+        NetworkMode plannedMode = NetworkMode::TRAIN;
+
+        bool isPlanned() const { return plannedBatchSize > 0; }
+        // Places the values and errors of every layer in workspace for
+        // batches of up to batchSize samples, buffers whose lifetimes
+        // across the forward and backward passes don't overlap share
+        // memory. EVAL plans for forward passes only, so each layer's
+        // values are reused once the next layer has read them
+        void planMemory(const usize batchSize, const NetworkMode mode = NetworkMode::TRAIN);
+
         template <LayerLike... Args>
         void init(const bool useXavierInit, Args&&... args) {
             (layers.emplace_back(std::make_unique<std::decay_t<Args>>(std::forward<Args>(args))), ...);
@@ -66,6 +99,11 @@ namespace Ember {
             for (const auto& layer : other.layers) {
                 layers.emplace_back(layer->clone());
             }
+
+            if (other.isFlat())
+                flattenParams();
+            if (other.isPlanned())
+                planMemory(other.plannedBatchSize, other.plannedMode);
         }
 
         template <LayerLike... Args>
@@ -73,7 +111,18 @@ namespace Ember {
             init(true, std::forward<Args>(args)...);
         }
 
+        // Run the GEMMs of compute layers on bf16 operands with fp32
+        // accumulation, activations and weights stay fp32. Refused with a
+        // warning when the CPU or OpenBLAS has no native bf16 GEMM, since
+        // it would only run slower. Returns whether bf16 GEMMs are in use
+        bool setBf16Gemm(const bool enabled);
+
+        // A thread count of 0 leaves the BLAS and OpenMP thread counts as they are
         void forward(const Tensor& input, const usize threads);
+        // Forward pass for networks starting with a SparseInput layer
+        void forward(const SparseTensor& input, const usize threads);
+        // Forward pass on whichever input the data point holds
+        void forward(const internal::DataPoint& data, const usize threads);
         const Tensor& output() const;
 
         Network& operator=(const Network& other) {
@@ -83,6 +132,18 @@ namespace Ember {
                 for (const auto& l : other.layers) {
                     layers.push_back(l->clone());
                 }
+
+                params.clear();
+                weightOffsets.clear();
+                biasOffsets.clear();
+                if (other.isFlat())
+                    flattenParams();
+
+                workspace.clear();
+                errors.clear();
+                plannedBatchSize = 0;
+                if (other.isPlanned())
+                    planMemory(other.plannedBatchSize, other.plannedMode);
             }
             return *this;
         }
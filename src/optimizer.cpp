@@ -1,41 +1,55 @@
 #include "optimizer.h"
 
+#include <algorithm>
+#include <atomic>
+
 namespace Ember {
     namespace internal {
         Optimizer::Optimizer(Network& net) : net(net) {
-            weightGradients.resize(net.layers.size());
-            biasGradients.resize(net.layers.size());
+            net.flattenParams();
+            viewArena(gradients, weightGradients, biasGradients);
+        }
+
+        Optimizer::Optimizer(const Optimizer& other) : net(other.net), gradients(other.gradients) {
+            viewArena(gradients, weightGradients, biasGradients);
+        }
+
+        void Optimizer::viewArena(Arena& arena, std::vector<Tensor>& weights, std::vector<Tensor>& biases) const {
+            arena.resize(net.params.size());
+
+            weights.clear();
+            biases.clear();
+            weights.resize(net.layers.size());
+            biases.resize(net.layers.size());
+
             for (usize i = 1; i < net.layers.size(); i++) {
-                const std::unique_ptr<Layer>& l = net.layers[i];
-                const auto* layer = dynamic_cast<ComputeLayer*>(l.get());
+                const auto* layer = dynamic_cast<ComputeLayer*>(net.layers[i].get());
                 if (!layer)
                     continue;
 
-                weightGradients[i].resize(layer->weights.dims());
-                biasGradients[i].resize(layer->biases.size());
+                weights[i].data.view(arena.data() + net.weightOffsets[i], layer->weights.size());
+                weights[i].resize(layer->weights.dims());
+                biases[i].data.view(arena.data() + net.biasOffsets[i], layer->biases.size());
+                biases[i].resize(layer->biases.size());
             }
         }
 
         void Optimizer::zeroGrad() {
-            for (auto& grad : weightGradients)
-                grad.fill(0);
+            float* grads = gradients.data();
 
-            for (auto& grad : biasGradients)
-                grad.fill(0);
+            #pragma omp parallel for simd
+            for (usize i = 0; i < gradients.size(); i++)
+                grads[i] = 0;
         }
 
         void Optimizer::clipGrad(const float maxNorm) {
+            float* grads = gradients.data();
+
             // Compute total norm of all gradients (weights and biases) across all layers
             double totalNormSq = 0.0;
-            // Weights gradients
-            for (const auto& layerGradients : weightGradients)
-                for (const float wg : layerGradients)
-                    totalNormSq += wg * wg;
-
-            // Bias gradients
-            for (const auto& layerGradients : biasGradients)
-                for (const float bg : layerGradients)
-                    totalNormSq += bg * bg;
+            #pragma omp parallel for simd reduction(+ : totalNormSq)
+            for (usize i = 0; i < gradients.size(); i++)
+                totalNormSq += grads[i] * grads[i];
 
             const float totalNorm = std::sqrt(totalNormSq);
 
@@ -43,58 +57,91 @@ namespace Ember {
             if (totalNorm > maxNorm && totalNorm > 0.0f) {
                 const float scale = maxNorm / totalNorm;
 
-                // Weights gradients
-                for (auto& layerGradients : weightGradients)
-                    for (float& wg : layerGradients)
-                        wg *= scale;
-
-                // Bias gradients
-                for (auto& layerGradients : biasGradients)
-                    for (float& bg : layerGradients)
-                        bg *= scale;
+                #pragma omp parallel for simd
+                for (usize i = 0; i < gradients.size(); i++)
+                    grads[i] *= scale;
             }
         }
     }
 
+    namespace internal {
+        void Optimizer::fusedStep(const float lr, const float maxNorm) {
+            const float* grads = gradients.data();
+
+            double totalNormSq = 0.0;
+            #pragma omp parallel for simd reduction(+ : totalNormSq)
+            for (usize i = 0; i < gradients.size(); i++)
+                totalNormSq += grads[i] * grads[i];
+
+            const float totalNorm = std::sqrt(totalNormSq);
+            const float gradScale = totalNorm > maxNorm && totalNorm > 0.0f ? maxNorm / totalNorm : 1.0f;
+
+            stepAndZero(lr, gradScale);
+        }
+    }
+
     namespace optimizers {
         SGD::SGD(Network& net, const float momentum) : Optimizer(net), momentum(momentum) {
-            weightVelocities.resize(net.layers.size());
-            biasVelocities.resize(net.layers.size());
+            viewArena(velocities, weightVelocities, biasVelocities);
+        }
 
-            for (usize i = 1; i < net.layers.size(); i++) {
-                const std::unique_ptr<internal::Layer>& l = net.layers[i];
-                const auto* layer = dynamic_cast<internal::ComputeLayer*>(l.get());
-                if (!layer)
-                    continue;
+        SGD::SGD(const SGD& other) : Optimizer(other), velocities(other.velocities), momentum(other.momentum) {
+            viewArena(velocities, weightVelocities, biasVelocities);
+        }
+
+        void SGD::step(const float lr) {
+            float* params = net.params.data();
+            float* velocity = velocities.data();
+            const float* grads = gradients.data();
 
-                weightVelocities[i].resize(layer->weights.dims());
-                biasVelocities[i].resize(layer->biases.size());
+            assert(net.params.size() == gradients.size());
+
+            // Update weights and biases with momentum
+            #pragma omp parallel for simd
+            for (usize i = 0; i < gradients.size(); i++) {
+                velocity[i] = momentum * velocity[i] - lr * grads[i];
+                params[i] += velocity[i];
             }
         }
 
-        void SGD::step(const float lr) {
+        void SGD::stepAndZero(const float lr, const float gradScale) {
+            float* params = net.params.data();
+            float* velocity = velocities.data();
+            float* grads = gradients.data();
+
+            const float scaledLr = lr * gradScale;
+
+            #pragma omp parallel for simd
+            for (usize i = 0; i < gradients.size(); i++) {
+                velocity[i] = momentum * velocity[i] - scaledLr * grads[i];
+                params[i] += velocity[i];
+                grads[i] = 0;
+            }
+        }
+
+        void SGD::asyncStep(const float lr, const float gradScale, const std::vector<Tensor>& weightGrads, const std::vector<Tensor>& biasGrads, const std::vector<std::vector<usize>>& rows) {
+            const auto update = [&](float& param, float& velocity, const float grad) {
+                std::atomic_ref p(param);
+                std::atomic_ref v(velocity);
+
+                const float newVelocity = momentum * v.load(std::memory_order_relaxed) - lr * grad * gradScale;
+                v.store(newVelocity, std::memory_order_relaxed);
+                p.store(p.load(std::memory_order_relaxed) + newVelocity, std::memory_order_relaxed);
+            };
+
             for (usize lIdx = 1; lIdx < net.layers.size(); lIdx++) {
-                std::unique_ptr<internal::Layer>& l = net.layers[lIdx];
-                auto* layer = dynamic_cast<internal::ComputeLayer*>(l.get());
+                auto* layer = dynamic_cast<internal::ComputeLayer*>(net.layers[lIdx].get());
                 if (!layer)
                     continue;
 
-                assert(weightVelocities[lIdx].data.size() == layer->weights.data.size());
-                assert(biasVelocities[lIdx].size() == layer->biases.size());
-                assert(weightGradients[lIdx].data.size() == layer->weights.data.size());
-                assert(biasGradients[lIdx].size() == layer->biases.size());
+                const usize rowSize = layer->weights.size() / layer->weights.dim(0);
 
-                // Update weights with momentum
-                for (usize i = 0; i < layer->weights.size(); i++) {
-                    weightVelocities[lIdx].data[i] = momentum * weightVelocities[lIdx].data[i] - lr * weightGradients[lIdx].data[i];
-                    layer->weights.data[i] += weightVelocities[lIdx].data[i];
-                }
+                for (const usize row : rows[lIdx])
+                    for (usize i = row * rowSize; i < (row + 1) * rowSize; i++)
+                        update(layer->weights.data[i], weightVelocities[lIdx].data[i], weightGrads[lIdx].data[i]);
 
-                // Update biases with momentum
-                for (usize i = 0; i < layer->biases.size(); i++) {
-                    biasVelocities[lIdx].data[i] = momentum * biasVelocities[lIdx].data[i] - lr * biasGradients[lIdx].data[i];
-                    layer->biases.data[i] += biasVelocities[lIdx].data[i];
-                }
+                for (usize i = 0; i < layer->biases.size(); i++)
+                    update(layer->biases.data[i], biasVelocities[lIdx].data[i], biasGrads[lIdx].data[i]);
             }
         }
 
@@ -107,72 +154,387 @@ namespace Ember {
             this->beta2 = beta2;
             this->epsilon = epsilon;
             this->decay = decay;
-            weightVelocities.resize(net.layers.size());
-            biasVelocities.resize(net.layers.size());
-            weightMomentum.resize(net.layers.size());
-            biasMomentum.resize(net.layers.size());
 
-            for (usize i = 1; i < net.layers.size(); i++) {
-                const std::unique_ptr<internal::Layer>& l = net.layers[i];
-                const auto* layer = dynamic_cast<internal::ComputeLayer*>(l.get());
-                if (!layer)
-                    continue;
+            viewArena(velocities, weightVelocities, biasVelocities);
+            viewArena(momentum, weightMomentum, biasMomentum);
+        }
 
-                weightVelocities[i].resize(layer->weights.dims());
-                biasVelocities[i].resize(layer->biases.size());
-                weightMomentum[i].resize(layer->weights.dims());
-                biasMomentum[i].resize(layer->biases.size());
-            }
+        Adam::Adam(const Adam& other)
+            : Optimizer(other), beta1(other.beta1), beta2(other.beta2), epsilon(other.epsilon), decay(other.decay), iteration(other.iteration),
+              velocities(other.velocities), momentum(other.momentum) {
+            viewArena(velocities, weightVelocities, biasVelocities);
+            viewArena(momentum, weightMomentum, biasMomentum);
         }
 
         void Adam::step(const float lr) {
             iteration++;
             const float biasCorr1 = 1.0f - std::pow(beta1, iteration);
             const float biasCorr2 = 1.0f - std::pow(beta2, iteration);
+            const float decayScale = 1.0f - lr * decay;
+
+            float* params = net.params.data();
+            float* m = momentum.data();
+            float* v = velocities.data();
+            const float* grads = gradients.data();
+
+            assert(net.params.size() == gradients.size());
+
+            // Update weights and biases
+            #pragma omp parallel for simd
+            for (usize i = 0; i < gradients.size(); i++) {
+                params[i] *= decayScale;
+
+                m[i] = beta1 * m[i] + (1.0f - beta1) * grads[i];
+                v[i] = beta2 * v[i] + (1.0f - beta2) * grads[i] * grads[i];
+
+                // Bias correction
+                const float mHat = m[i] / biasCorr1;
+                const float vHat = v[i] / biasCorr2;
+
+                params[i] -= lr * mHat / (std::sqrt(vHat) + epsilon);
+            }
+        }
+
+        void Adam::stepAndZero(const float lr, const float gradScale) {
+            iteration++;
+
+            // Bias corrections folded into the step size and the velocity
+            // scale so the sweep has one sqrt and one division
+            const float stepSize = lr / (1.0f - std::pow(beta1, iteration));
+            const float velocityScale = 1.0f / std::sqrt(1.0f - std::pow(beta2, iteration));
+            const float decayScale = 1.0f - lr * decay;
+            const float oneMinusBeta1 = 1.0f - beta1;
+            const float oneMinusBeta2 = 1.0f - beta2;
+
+            float* params = net.params.data();
+            float* m = momentum.data();
+            float* v = velocities.data();
+            float* grads = gradients.data();
+
+            #pragma omp parallel for simd
+            for (usize i = 0; i < gradients.size(); i++) {
+                const float grad = grads[i] * gradScale;
+
+                m[i] = beta1 * m[i] + oneMinusBeta1 * grad;
+                v[i] = beta2 * v[i] + oneMinusBeta2 * grad * grad;
+
+                params[i] = params[i] * decayScale - stepSize * m[i] / (std::sqrt(v[i]) * velocityScale + epsilon);
+                grads[i] = 0;
+            }
+        }
+
+        void Adam::asyncStep(const float lr, const float gradScale, const std::vector<Tensor>& weightGrads, const std::vector<Tensor>& biasGrads, const std::vector<std::vector<usize>>& rows) {
+            const usize step = std::atomic_ref(iteration).fetch_add(1, std::memory_order_relaxed) + 1;
+            const float biasCorr1 = 1.0f - std::pow(beta1, step);
+            const float biasCorr2 = 1.0f - std::pow(beta2, step);
+
+            const auto update = [&](float& param, float& momentum, float& velocity, float grad) {
+                std::atomic_ref p(param);
+                std::atomic_ref m(momentum);
+                std::atomic_ref v(velocity);
+
+                grad *= gradScale;
+
+                const float newMomentum = beta1 * m.load(std::memory_order_relaxed) + (1.0f - beta1) * grad;
+                const float newVelocity = beta2 * v.load(std::memory_order_relaxed) + (1.0f - beta2) * grad * grad;
+                m.store(newMomentum, std::memory_order_relaxed);
+                v.store(newVelocity, std::memory_order_relaxed);
+
+                // Bias correction
+                const float mHat = newMomentum / biasCorr1;
+                const float vHat = newVelocity / biasCorr2;
+
+                const float decayed = p.load(std::memory_order_relaxed) * (1.0f - lr * decay);
+                p.store(decayed - lr * mHat / (std::sqrt(vHat) + epsilon), std::memory_order_relaxed);
+            };
 
             for (usize lIdx = 1; lIdx < net.layers.size(); lIdx++) {
-                std::unique_ptr<internal::Layer>& l = net.layers[lIdx];
-                auto* layer = dynamic_cast<internal::ComputeLayer*>(l.get());
+                auto* layer = dynamic_cast<internal::ComputeLayer*>(net.layers[lIdx].get());
+                if (!layer)
+                    continue;
+
+                const usize rowSize = layer->weights.size() / layer->weights.dim(0);
+
+                for (const usize row : rows[lIdx])
+                    for (usize i = row * rowSize; i < (row + 1) * rowSize; i++)
+                        update(layer->weights.data[i], weightMomentum[lIdx].data[i], weightVelocities[lIdx].data[i], weightGrads[lIdx].data[i]);
+
+                for (usize i = 0; i < layer->biases.size(); i++)
+                    update(layer->biases.data[i], biasMomentum[lIdx].data[i], biasVelocities[lIdx].data[i], biasGrads[lIdx].data[i]);
+            }
+        }
+
+        std::unique_ptr<internal::Optimizer> Adam::clone() const {
+            return std::make_unique<Adam>(*this);
+        }
+
+        SparseAdam::SparseAdam(Network& net, const float beta1, const float beta2, const float epsilon, const float decay) : Adam(net, beta1, beta2, epsilon, decay) {
+            lastStep.resize(net.layers.size());
+            touchedRows.resize(net.layers.size());
+            isTouched.resize(net.layers.size());
+
+            for (usize i = 1; i < net.layers.size(); i++) {
+                const auto* layer = dynamic_cast<internal::ComputeLayer*>(net.layers[i].get());
                 if (!layer)
                     continue;
 
-                assert(weightVelocities[lIdx].data.size() == layer->weights.data.size());
-                assert(biasVelocities[lIdx].size() == layer->biases.size());
-                assert(weightGradients[lIdx].data.size() == layer->weights.data.size());
-                assert(biasGradients[lIdx].size() == layer->biases.size());
+                if (dynamic_cast<const layers::SparseLinear*>(layer)) {
+                    sparseLayers.push_back(i);
+                    lastStep[i].resize(layer->weights.dim(0));
+                    isTouched[i].resize(layer->weights.dim(0));
+                }
+                else
+                    denseRanges.emplace_back(net.weightOffsets[i], net.weightOffsets[i] + layer->weights.size());
+
+                denseRanges.emplace_back(net.biasOffsets[i], net.biasOffsets[i] + layer->biases.size());
+            }
+        }
+
+        usize SparseAdam::rowSize(const usize lIdx) const {
+            return weightGradients[lIdx].size() / weightGradients[lIdx].dim(0);
+        }
+
+        void SparseAdam::markTouched(const Network& model) {
+            for (const usize lIdx : sparseLayers) {
+                const auto& features = static_cast<const layers::SparseInput*>(model.layers[lIdx - 1].get())->features;
+
+                for (const i32 feature : features.indices) {
+                    if (feature >= 0 && !isTouched[lIdx][feature]) {
+                        isTouched[lIdx][feature] = true;
+                        touchedRows[lIdx].push_back(feature);
+                    }
+                }
+            }
+        }
+
+        void SparseAdam::markGradientRows() {
+            for (const usize lIdx : sparseLayers) {
+                const usize size = rowSize(lIdx);
+                const float* grads = weightGradients[lIdx].ptr();
+
+                for (usize row = 0; row < isTouched[lIdx].size(); row++) {
+                    if (isTouched[lIdx][row])
+                        continue;
+
+                    if (std::any_of(grads + row * size, grads + (row + 1) * size, [](const float g) { return g != 0; })) {
+                        isTouched[lIdx][row] = true;
+                        touchedRows[lIdx].push_back(row);
+                    }
+                }
+            }
+        }
+
+        void SparseAdam::fusedStep(const float lr, const float maxNorm) {
+            const float* grads = gradients.data();
+
+            // Untouched rows have no gradient so they are skipped
+            double totalNormSq = 0.0;
+            for (const auto& [begin, end] : denseRanges) {
+                #pragma omp parallel for simd reduction(+ : totalNormSq)
+                for (usize i = begin; i < end; i++)
+                    totalNormSq += grads[i] * grads[i];
+            }
+
+            for (const usize lIdx : sparseLayers) {
+                const usize size = rowSize(lIdx);
+                const float* layerGrads = weightGradients[lIdx].ptr();
+                const auto& rows = touchedRows[lIdx];
+
+                #pragma omp parallel for reduction(+ : totalNormSq)
+                for (usize r = 0; r < rows.size(); r++)
+                    for (usize i = rows[r] * size; i < (rows[r] + 1) * size; i++)
+                        totalNormSq += layerGrads[i] * layerGrads[i];
+            }
+
+            const float totalNorm = std::sqrt(totalNormSq);
+            const float gradScale = totalNorm > maxNorm && totalNorm > 0.0f ? maxNorm / totalNorm : 1.0f;
+
+            sparseStep(lr, gradScale, true);
+        }
+
+        void SparseAdam::step(const float lr) {
+            sparseStep(lr, 1, false);
+        }
+
+        void SparseAdam::stepAndZero(const float lr, const float gradScale) {
+            sparseStep(lr, gradScale, true);
+        }
+
+        void SparseAdam::sparseStep(const float lr, const float gradScale, const bool zero) {
+            iteration++;
+            lastLr = lr;
+
+            const float stepSize = lr / (1.0f - std::pow(beta1, iteration));
+            const float velocityScale = 1.0f / std::sqrt(1.0f - std::pow(beta2, iteration));
+            const float decayScale = 1.0f - lr * decay;
+            const float oneMinusBeta1 = 1.0f - beta1;
+            const float oneMinusBeta2 = 1.0f - beta2;
+
+            float* params = net.params.data();
+            float* m = momentum.data();
+            float* v = velocities.data();
+            float* grads = gradients.data();
+
+            const auto update = [&](const usize i) {
+                const float grad = grads[i] * gradScale;
+
+                m[i] = beta1 * m[i] + oneMinusBeta1 * grad;
+                v[i] = beta2 * v[i] + oneMinusBeta2 * grad * grad;
+
+                params[i] = params[i] * decayScale - stepSize * m[i] / (std::sqrt(v[i]) * velocityScale + epsilon);
+                if (zero)
+                    grads[i] = 0;
+            };
+
+            for (const auto& [begin, end] : denseRanges) {
+                #pragma omp parallel for simd
+                for (usize i = begin; i < end; i++)
+                    update(i);
+            }
+
+            for (const usize lIdx : sparseLayers) {
+                const usize size = rowSize(lIdx);
+                const usize offset = net.weightOffsets[lIdx];
+                auto& rows = touchedRows[lIdx];
+
+                #pragma omp parallel for
+                for (usize r = 0; r < rows.size(); r++) {
+                    const usize row = rows[r];
+                    const u64 skipped = iteration - lastStep[lIdx][row] - 1;
+
+                    // Catch up on the steps the row was not touched in
+                    if (skipped > 0) {
+                        const float momentumDecay = std::pow(beta1, skipped);
+                        const float velocityDecay = std::pow(beta2, skipped);
+                        const float paramDecay = std::pow(decayScale, skipped);
+
+                        for (usize i = offset + row * size; i < offset + (row + 1) * size; i++) {
+                            m[i] *= momentumDecay;
+                            v[i] *= velocityDecay;
+                            params[i] *= paramDecay;
+                        }
+                    }
+
+                    #pragma omp simd
+                    for (usize i = offset + row * size; i < offset + (row + 1) * size; i++)
+                        update(i);
+
+                    lastStep[lIdx][row] = iteration;
+                    isTouched[lIdx][row] = false;
+                }
+
+                rows.clear();
+            }
+        }
 
-                // Update weights
-                for (usize i = 0; i < layer->weights.size(); i++) {
-                    layer->weights.data[i] *= 1.0f - lr * decay;
+        void SparseAdam::asyncStep(const float lr, const float gradScale, const std::vector<Tensor>& weightGrads, const std::vector<Tensor>& biasGrads, const std::vector<std::vector<usize>>& rows) {
+            const u64 step = std::atomic_ref(iteration).fetch_add(1, std::memory_order_relaxed) + 1;
+            std::atomic_ref(lastLr).store(lr, std::memory_order_relaxed);
 
-                    weightMomentum[lIdx].data[i] = beta1 * weightMomentum[lIdx].data[i] + (1.0f - beta1) * weightGradients[lIdx].data[i];
-                    weightVelocities[lIdx].data[i] = beta2 * weightVelocities[lIdx].data[i] + (1.0f - beta2) * weightGradients[lIdx].data[i] * weightGradients[lIdx].data[i];
+            const float biasCorr1 = 1.0f - std::pow(beta1, step);
+            const float biasCorr2 = 1.0f - std::pow(beta2, step);
+            const float decayScale = 1.0f - lr * decay;
 
-                    // Bias correction
-                    const float mHat = weightMomentum[lIdx].data[i] / biasCorr1;
-                    const float vHat = weightVelocities[lIdx].data[i] / biasCorr2;
+            const auto update = [&](float& param, float& momentum, float& velocity, float grad) {
+                std::atomic_ref p(param);
+                std::atomic_ref m(momentum);
+                std::atomic_ref v(velocity);
 
-                    layer->weights.data[i] -= lr * mHat / (std::sqrt(vHat) + epsilon);
+                grad *= gradScale;
+
+                const float newMomentum = beta1 * m.load(std::memory_order_relaxed) + (1.0f - beta1) * grad;
+                const float newVelocity = beta2 * v.load(std::memory_order_relaxed) + (1.0f - beta2) * grad * grad;
+                m.store(newMomentum, std::memory_order_relaxed);
+                v.store(newVelocity, std::memory_order_relaxed);
+
+                // Bias correction
+                const float mHat = newMomentum / biasCorr1;
+                const float vHat = newVelocity / biasCorr2;
+
+                const float decayed = p.load(std::memory_order_relaxed) * decayScale;
+                p.store(decayed - lr * mHat / (std::sqrt(vHat) + epsilon), std::memory_order_relaxed);
+            };
+
+            const auto scale = [](float& value, const float factor) {
+                std::atomic_ref ref(value);
+                ref.store(ref.load(std::memory_order_relaxed) * factor, std::memory_order_relaxed);
+            };
+
+            for (usize lIdx = 1; lIdx < net.layers.size(); lIdx++) {
+                auto* layer = dynamic_cast<internal::ComputeLayer*>(net.layers[lIdx].get());
+                if (!layer)
+                    continue;
+
+                const usize size = rowSize(lIdx);
+                const bool sparse = !lastStep[lIdx].empty();
+
+                for (const usize row : rows[lIdx]) {
+                    if (sparse) {
+                        // Claim the row for this step, a thread that already
+                        // stepped it at a later iteration did the catch up
+                        std::atomic_ref last(lastStep[lIdx][row]);
+                        u64 previous = last.load(std::memory_order_relaxed);
+                        while (previous < step && !last.compare_exchange_weak(previous, step, std::memory_order_relaxed)) {}
+
+                        const u64 skipped = previous < step ? step - previous - 1 : 0;
+
+                        // Catch up on the steps the row was not touched in
+                        if (skipped > 0) {
+                            const float momentumDecay = std::pow(beta1, skipped);
+                            const float velocityDecay = std::pow(beta2, skipped);
+                            const float paramDecay = std::pow(decayScale, skipped);
+
+                            for (usize i = row * size; i < (row + 1) * size; i++) {
+                                scale(weightMomentum[lIdx].data[i], momentumDecay);
+                                scale(weightVelocities[lIdx].data[i], velocityDecay);
+                                scale(layer->weights.data[i], paramDecay);
+                            }
+                        }
+                    }
+
+                    for (usize i = row * size; i < (row + 1) * size; i++)
+                        update(layer->weights.data[i], weightMomentum[lIdx].data[i], weightVelocities[lIdx].data[i], weightGrads[lIdx].data[i]);
                 }
 
-                // Update biases
-                for (usize i = 0; i < layer->biases.size(); i++) {
-                    layer->biases.data[i] *= (1.0f - lr * decay);
+                for (usize i = 0; i < layer->biases.size(); i++)
+                    update(layer->biases.data[i], biasMomentum[lIdx].data[i], biasVelocities[lIdx].data[i], biasGrads[lIdx].data[i]);
+            }
+        }
+
+        void SparseAdam::flush() {
+            const float decayScale = 1.0f - lastLr * decay;
+
+            float* params = net.params.data();
+            float* m = momentum.data();
+            float* v = velocities.data();
 
-                    biasMomentum[lIdx].data[i] = beta1 * biasMomentum[lIdx].data[i] + (1.0f - beta1) * biasGradients[lIdx].data[i];
-                    biasVelocities[lIdx].data[i] = beta2 * biasVelocities[lIdx].data[i] + (1.0f - beta2) * biasGradients[lIdx].data[i] * biasGradients[lIdx].data[i];
+            for (const usize lIdx : sparseLayers) {
+                const usize size = rowSize(lIdx);
+                const usize offset = net.weightOffsets[lIdx];
 
-                    // Bias correction
-                    const float mHat = biasMomentum[lIdx].data[i] / biasCorr1;
-                    const float vHat = biasVelocities[lIdx].data[i] / biasCorr2;
+                #pragma omp parallel for
+                for (usize row = 0; row < lastStep[lIdx].size(); row++) {
+                    const u64 skipped = iteration - lastStep[lIdx][row];
+                    if (skipped == 0)
+                        continue;
 
-                    layer->biases.data[i] -= lr * mHat / (std::sqrt(vHat) + epsilon);
+                    const float momentumDecay = std::pow(beta1, skipped);
+                    const float velocityDecay = std::pow(beta2, skipped);
+                    const float paramDecay = std::pow(decayScale, skipped);
+
+                    for (usize i = offset + row * size; i < offset + (row + 1) * size; i++) {
+                        m[i] *= momentumDecay;
+                        v[i] *= velocityDecay;
+                        params[i] *= paramDecay;
+                    }
+
+                    lastStep[lIdx][row] = iteration;
                 }
             }
         }
 
-        std::unique_ptr<internal::Optimizer> Adam::clone() const {
-            return std::make_unique<Adam>(*this);
+        std::unique_ptr<internal::Optimizer> SparseAdam::clone() const {
+            return std::make_unique<SparseAdam>(*this);
         }
     }
 }
\ No newline at end of file
@@ -9,35 +9,70 @@ namespace Ember {
         struct Optimizer {
             Network& net;
 
+            // Gradients laid out like net.params, the
+            // per layer tensors are views into it
+            Arena gradients;
             std::vector<Tensor> weightGradients;
             std::vector<Tensor> biasGradients;
 
+            // Flattens the parameters of net
             explicit Optimizer(Network& net);
 
-            Optimizer(const Optimizer& other) : net(other.net), weightGradients(other.weightGradients), biasGradients(other.biasGradients) {}
+            Optimizer(const Optimizer& other);
 
             void zeroGrad();
 
             void clipGrad(const float maxNorm);
 
             virtual void step(float lr) = 0;
+
+            // Same result as clipGrad(maxNorm), step(lr) then zeroGrad()
+            // but reads the gradients only twice, once for the norm and
+            // once in a single sweep that updates and clears them
+            virtual void fusedStep(const float lr, const float maxNorm);
+            // Step on gradients multiplied by gradScale then zero them
+            virtual void stepAndZero(float lr, float gradScale) = 0;
+
+            // Lock-free step from gradients owned by the calling thread
+            // Only the weight rows listed in rows[layer] are updated and
+            // the gradients are multiplied by gradScale. Other threads
+            // may be stepping at the same time so shared values are
+            // read and written with relaxed atomics
+            virtual void asyncStep(float lr, float gradScale, const std::vector<Tensor>& weightGrads, const std::vector<Tensor>& biasGrads, const std::vector<std::vector<usize>>& rows) = 0;
+
+            // Sparse aware optimizers only update the rows of SparseLinear
+            // weights whose features were active in the last batch of model
+            virtual void markTouched([[maybe_unused]] const Network& model) {}
+            // Marks the rows with nonzero gradients instead, for gradients
+            // that came from elsewhere such as another process
+            virtual void markGradientRows() {}
+            // Brings any lazily updated state up to date
+            virtual void flush() {}
+
             virtual std::unique_ptr<Optimizer> clone() const = 0;
 
             virtual ~Optimizer() = default;
+
+           protected:
+            // Sizes an arena like net.params and points the per layer tensors into it
+            void viewArena(Arena& arena, std::vector<Tensor>& weights, std::vector<Tensor>& biases) const;
         };
     }
 
     namespace optimizers {
         struct SGD : internal::Optimizer {
+            internal::Arena velocities;
             std::vector<Tensor> weightVelocities;
             std::vector<Tensor> biasVelocities;
 
             float momentum;
 
             SGD(Network& net, const float momentum = 0.9f);
-            SGD(const SGD& other) = default;
+            SGD(const SGD& other);
 
             void step(const float lr) override;
+            void stepAndZero(const float lr, const float gradScale) override;
+            void asyncStep(const float lr, const float gradScale, const std::vector<Tensor>& weightGrads, const std::vector<Tensor>& biasGrads, const std::vector<std::vector<usize>>& rows) override;
 
             std::unique_ptr<Optimizer> clone() const override;
         };
@@ -49,17 +84,57 @@ namespace Ember {
             float decay;
             usize iteration = 0;
 
+            internal::Arena velocities;
+            internal::Arena momentum;
             std::vector<Tensor> weightVelocities;
             std::vector<Tensor> biasVelocities;
             std::vector<Tensor> weightMomentum;
             std::vector<Tensor> biasMomentum;
 
             explicit Adam(Network& net, const float beta1 = 0.9f, const float beta2 = 0.999f, const float epsilon = 1e-08, const float decay = 0.01f);
-            Adam(const Adam& other) = default;
+            Adam(const Adam& other);
 
             void step(const float lr) override;
+            void stepAndZero(const float lr, const float gradScale) override;
+            void asyncStep(const float lr, const float gradScale, const std::vector<Tensor>& weightGrads, const std::vector<Tensor>& biasGrads, const std::vector<std::vector<usize>>& rows) override;
 
             std::unique_ptr<Optimizer> clone() const override;
         };
+
+        // Adam that only updates the SparseLinear weight rows of features
+        // active in a batch. A row that was skipped for k steps first has
+        // its moments decayed by beta^k and its weight decay applied k
+        // times when it is next touched or flushed, the small updates
+        // Adam would make from the decaying moments alone are skipped
+        struct SparseAdam : Adam {
+            // Compute layers whose weights are updated by row
+            std::vector<usize> sparseLayers;
+            // Step each row was last updated at, rows touched this step
+            std::vector<std::vector<u64>> lastStep;
+            std::vector<std::vector<usize>> touchedRows;
+            std::vector<std::vector<u8>> isTouched;
+            // [begin, end) ranges of the arenas that are updated every step
+            std::vector<std::pair<usize, usize>> denseRanges;
+
+            float lastLr = 0;
+
+            explicit SparseAdam(Network& net, const float beta1 = 0.9f, const float beta2 = 0.999f, const float epsilon = 1e-08, const float decay = 0.01f);
+            SparseAdam(const SparseAdam& other) = default;
+
+            void step(const float lr) override;
+            void fusedStep(const float lr, const float maxNorm) override;
+            void stepAndZero(const float lr, const float gradScale) override;
+            void asyncStep(const float lr, const float gradScale, const std::vector<Tensor>& weightGrads, const std::vector<Tensor>& biasGrads, const std::vector<std::vector<usize>>& rows) override;
+
+            void markTouched(const Network& model) override;
+            void markGradientRows() override;
+            void flush() override;
+
+            std::unique_ptr<Optimizer> clone() const override;
+
+           private:
+            usize rowSize(const usize lIdx) const;
+            void sparseStep(const float lr, const float gradScale, const bool zero);
+        };
     }
 }
\ No newline at end of file
@@ -0,0 +1,242 @@
+#include "processgroup.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace Ember {
+    constexpr u64 PROCESS_GROUP_MAGIC = 0x50524745424D45; // "EMBEGRP"
+
+    // Calls f(ptr, size) for every compute layer's weights then biases
+    template <typename Function>
+    void forEachParam(Network& net, Function&& f) {
+        for (auto& l : net.layers) {
+            if (auto* layer = dynamic_cast<internal::ComputeLayer*>(l.get())) {
+                f(layer->weights.ptr(), layer->weights.size());
+                f(layer->biases.ptr(), layer->biases.size());
+            }
+        }
+    }
+
+    ProcessGroup::ProcessGroup(const std::string& path, const usize rank, const usize worldSize, const u64 runId, const Network& net) : rank(rank), worldSize(worldSize), path(path) {
+        if (worldSize == 0 || rank >= worldSize)
+            exitWithMsg(fmt::format("Invalid rank {} for a process group of {}", rank, worldSize), 1);
+
+        for (const auto& l : net.layers)
+            if (const auto* layer = dynamic_cast<const internal::ComputeLayer*>(l.get()))
+                numFloats += layer->weights.size() + layer->biases.size();
+
+        regionSize = BUFFER_OFFSET + (worldSize + 1) * numFloats * sizeof(float);
+
+        // Rank 0 starts from a fresh file so no state of an earlier run is seen
+        if (rank == 0) {
+            std::filesystem::remove(path);
+            createRegion();
+
+            header().worldSize = worldSize;
+            header().numFloats = numFloats;
+            header().runId = runId;
+            header().arrived = 0;
+            header().generation = 0;
+
+            // Written last so the other ranks see a complete header
+            std::atomic_ref(header().magic).store(PROCESS_GROUP_MAGIC, std::memory_order_release);
+        }
+        else {
+            // A file left by an earlier run is mapped again until rank 0
+            // replaces it with one carrying this run's id
+            while (!tryOpenRegion(runId))
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+            if (header().worldSize != worldSize || header().numFloats != numFloats)
+                exitWithMsg("Every process in a process group must use the same world size and network", 1);
+        }
+
+        barrier();
+    }
+
+    void ProcessGroup::createRegion() {
+        #ifdef _WIN32
+        file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+            exitWithMsg("Failed to create process group file: " + path, 1);
+
+        LARGE_INTEGER size;
+        size.QuadPart = regionSize;
+        SetFilePointerEx(file, size, nullptr, FILE_BEGIN);
+        SetEndOfFile(file);
+
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE, 0, 0, nullptr);
+        if (mapping != nullptr)
+            region = static_cast<u8*>(MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, regionSize));
+        #else
+        const int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd < 0)
+            exitWithMsg("Failed to create process group file: " + path, 1);
+
+        if (ftruncate(fd, regionSize) != 0)
+            exitWithMsg("Failed to size process group file: " + path, 1);
+
+        void* ptr = mmap(nullptr, regionSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (ptr != MAP_FAILED)
+            region = static_cast<u8*>(ptr);
+        #endif
+
+        if (region == nullptr)
+            exitWithMsg("Failed to map process group file: " + path, 1);
+    }
+
+    bool ProcessGroup::tryOpenRegion(const u64 runId) {
+        // The file at path is opened afresh every attempt, so a stale
+        // file replaced by rank 0 is never waited on
+        #ifdef _WIN32
+        file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+            return false;
+
+        LARGE_INTEGER size{};
+        if (GetFileSizeEx(file, &size) && static_cast<usize>(size.QuadPart) >= regionSize) {
+            mapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE, 0, 0, nullptr);
+            if (mapping != nullptr)
+                region = static_cast<u8*>(MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, regionSize));
+        }
+        #else
+        const int fd = ::open(path.c_str(), O_RDWR);
+        if (fd < 0)
+            return false;
+
+        struct stat info{};
+        if (fstat(fd, &info) == 0 && static_cast<usize>(info.st_size) >= regionSize) {
+            void* ptr = mmap(nullptr, regionSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (ptr != MAP_FAILED)
+                region = static_cast<u8*>(ptr);
+        }
+        ::close(fd);
+        #endif
+
+        if (region != nullptr && std::atomic_ref(header().magic).load(std::memory_order_acquire) == PROCESS_GROUP_MAGIC && header().runId == runId)
+            return true;
+
+        closeRegion();
+        return false;
+    }
+
+    void ProcessGroup::closeRegion() {
+        #ifdef _WIN32
+        if (region != nullptr)
+            UnmapViewOfFile(region);
+        if (mapping != nullptr)
+            CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE)
+            CloseHandle(file);
+        mapping = nullptr;
+        file = INVALID_HANDLE_VALUE;
+        #else
+        if (region != nullptr)
+            munmap(region, regionSize);
+        #endif
+        region = nullptr;
+    }
+
+    void ProcessGroup::barrier() {
+        std::atomic_ref arrived(header().arrived);
+        std::atomic_ref generation(header().generation);
+
+        const u64 current = generation.load(std::memory_order_acquire);
+
+        // The last process to arrive releases the others
+        if (arrived.fetch_add(1, std::memory_order_acq_rel) + 1 == worldSize) {
+            arrived.store(0, std::memory_order_relaxed);
+            generation.fetch_add(1, std::memory_order_release);
+        }
+        else {
+            while (generation.load(std::memory_order_acquire) == current)
+                std::this_thread::yield();
+        }
+    }
+
+    void ProcessGroup::allReduce(std::vector<Tensor>& weightGrads, std::vector<Tensor>& biasGrads) {
+        // Gradients are packed in layer order, weights then biases
+        const auto forEachGrad = [&](auto&& f) {
+            for (usize i = 0; i < weightGrads.size(); i++) {
+                f(weightGrads[i].ptr(), weightGrads[i].size());
+                f(biasGrads[i].ptr(), biasGrads[i].size());
+            }
+        };
+
+        usize offset = 0;
+        forEachGrad([&](const float* grad, const usize size) {
+            std::copy_n(grad, size, buffer(rank) + offset);
+            offset += size;
+        });
+        assert(offset == numFloats);
+
+        barrier();
+
+        // Every process sums its own slice of the buffers, always in
+        // rank order so each process ends with identical gradients
+        const usize sliceSize = (numFloats + worldSize - 1) / worldSize;
+        const usize sliceStart = std::min(numFloats, rank * sliceSize);
+        const usize sliceEnd = std::min(numFloats, sliceStart + sliceSize);
+
+        float* reduced = buffer(worldSize);
+        const float scalar = 1.0f / worldSize;
+        for (usize i = sliceStart; i < sliceEnd; i++) {
+            float sum = 0;
+            for (usize r = 0; r < worldSize; r++)
+                sum += buffer(r)[i];
+            reduced[i] = sum * scalar;
+        }
+
+        barrier();
+
+        offset = 0;
+        forEachGrad([&](float* grad, const usize size) {
+            std::copy_n(reduced + offset, size, grad);
+            offset += size;
+        });
+    }
+
+    void ProcessGroup::broadcast(Network& net) {
+        usize offset = 0;
+        if (rank == 0) {
+            forEachParam(net, [&](const float* param, const usize size) {
+                std::copy_n(param, size, buffer(worldSize) + offset);
+                offset += size;
+            });
+        }
+
+        barrier();
+
+        if (rank != 0) {
+            forEachParam(net, [&](float* param, const usize size) {
+                std::copy_n(buffer(worldSize) + offset, size, param);
+                offset += size;
+            });
+        }
+
+        barrier();
+    }
+
+    ProcessGroup::~ProcessGroup() {
+        if (region == nullptr)
+            return;
+
+        barrier();
+
+        closeRegion();
+
+        if (rank == 0)
+            std::filesystem::remove(path);
+    }
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include "network.h"
+
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#endif
+
+namespace Ember {
+    // Trainer processes on one machine that average their gradients
+    // through a file backed shared memory region, so every process
+    // steps identical weights. Each process should be given its own
+    // rank in [0, worldSize) and the same path and run id, such as the
+    // launcher's start time. Rank 0 creates the region and the others
+    // wait for one carrying their run id, so a file left behind by a
+    // crashed run is never joined
+    struct ProcessGroup {
+        usize rank;
+        usize worldSize;
+
+        // Number of floats in every buffer, the parameter count of the network
+        usize numFloats = 0;
+
+        ProcessGroup(const std::string& path, const usize rank, const usize worldSize, const u64 runId, const Network& net);
+
+        ProcessGroup(const ProcessGroup&) = delete;
+        ProcessGroup& operator=(const ProcessGroup&) = delete;
+
+        // Blocks until every process reaches the barrier
+        void barrier();
+
+        // Averages the gradients of every process in place
+        void allReduce(std::vector<Tensor>& weightGrads, std::vector<Tensor>& biasGrads);
+
+        // Copies the parameters of rank 0 to every process
+        void broadcast(Network& net);
+
+        ~ProcessGroup();
+
+       private:
+        struct Header {
+            u64 magic;
+            u64 worldSize;
+            u64 numFloats;
+            u64 runId;
+            u64 arrived;
+            u64 generation;
+        };
+
+        std::string path;
+
+        u8* region = nullptr;
+        usize regionSize = 0;
+
+        #ifdef _WIN32
+        HANDLE file = INVALID_HANDLE_VALUE;
+        HANDLE mapping = nullptr;
+        #endif
+
+        // Rank 0 creates and maps a fresh file, the others map it
+        // once its header carries their run id
+        void createRegion();
+        bool tryOpenRegion(const u64 runId);
+        void closeRegion();
+
+        Header& header() { return *reinterpret_cast<Header*>(region); }
+        // One buffer per rank followed by the reduced buffer
+        float* buffer(const usize idx) { return reinterpret_cast<float*>(region + BUFFER_OFFSET) + idx * numFloats; }
+
+        static constexpr usize BUFFER_OFFSET = 64;
+    };
+}
@@ -0,0 +1,257 @@
+#pragma once
+
+#include "types.h"
+#include "layer.h"
+
+// Depthwise separable convolutions, a depthwise convolution filtering
+// each channel on its own followed by a pointwise convolution mixing
+// the channels of each pixel
+namespace Ember::layers {
+    // Convolves each input channel with its own kernel, the output has
+    // as many channels as the input
+    struct DepthwiseConvolution : internal::ComputeLayer {
+        // Weights are stored by kernel position, weights[tap][channel]
+        // with taps indexed kernelX * kernelSize + kernelY, so the
+        // weights of a tap are contiguous like the channels of a pixel.
+        // Runs in fp32 also under mixed precision, there are no matrix
+        // products to speed up
+
+        usize outX;
+        usize outY;
+
+        usize kernelSize;
+        usize stride;
+
+        usize x;
+        usize y;
+        usize channels;
+
+        // Channels whose sums are kept in registers at once
+        static constexpr usize BLOCK = 16;
+
+        mutable std::vector<std::vector<float>> threadWeightGrads;
+
+        explicit DepthwiseConvolution(const usize kernelSize, const usize stride = 1) : ComputeLayer(0), kernelSize(kernelSize), stride(stride) {
+            outX = outY = 0;
+            x = y = 0;
+            channels = 0;
+        }
+
+        void init(const Tensor& previous) override {
+            // Batch size, x, y, channels
+            assert(previous.dimensionality == 4);
+
+            x = previous.dim(1);
+            y = previous.dim(2);
+            channels = previous.dim(3);
+
+            outX = (x - kernelSize) / stride + 1;
+            outY = (y - kernelSize) / stride + 1;
+
+            values.resize(static_cast<usize>(1), outX, outY, channels);
+
+            weights.resize(kernelSize * kernelSize, channels);
+            biases.resize(channels);
+        }
+
+        // Offset of the first channel of a tap from the pixel at the
+        // origin of the patch
+        usize tapOffset(const usize tap) const {
+            return (tap / kernelSize * y + tap % kernelSize) * channels;
+        }
+
+        // Forward pass
+        // Accumulates the taps of each output pixel a block of channels
+        // at a time, vectorized over the channels
+        void forward(const Layer& previous) override {
+            const usize batchSize = values.dim(0);
+            const usize taps = kernelSize * kernelSize;
+            const float* in = previous.values.ptr();
+
+            #pragma omp parallel for
+            for (usize line = 0; line < batchSize * outX; line++) {
+                const usize n = line / outX;
+                const usize ox = line % outX;
+
+                for (usize oy = 0; oy < outY; oy++) {
+                    const float* origin = in + ((n * x + ox * stride) * y + oy * stride) * channels;
+                    float* pixel = values.ptr() + (line * outY + oy) * channels;
+
+                    for (usize c0 = 0; c0 < channels; c0 += BLOCK) {
+                        const usize width = std::min(BLOCK, channels - c0);
+
+                        float sums[BLOCK];
+                        std::copy_n(biases.ptr() + c0, width, sums);
+
+                        for (usize tap = 0; tap < taps; tap++) {
+                            const float* input = origin + tapOffset(tap) + c0;
+                            const float* kernel = weights.ptr() + tap * channels + c0;
+
+                            #pragma omp simd
+                            for (usize j = 0; j < width; j++)
+                                sums[j] += input[j] * kernel[j];
+                        }
+
+                        std::copy_n(sums, width, pixel + c0);
+                    }
+                }
+            }
+        }
+
+        // Each thread scatters the input gradients of its samples and
+        // sums their weight gradients into its own partial, the partials
+        // are reduced in thread order
+        void backward(const Layer& previous, const Tensor& gradOutput, Tensor& gradInput, Tensor& weightGrad, Tensor& biasGrad, const float scale) const override {
+            const usize batchSize = values.dim(0);
+            const usize taps = kernelSize * kernelSize;
+            const float* in = previous.values.ptr();
+
+            gradInput.resize(previous.values.dims());
+
+            for (usize i = 0; i < batchSize * outX * outY; i++)
+                for (usize c = 0; c < channels; c++)
+                    biasGrad[c] += scale * gradOutput.data[i * channels + c];
+
+            threadWeightGrads.resize(omp_get_max_threads());
+            for (auto& partial : threadWeightGrads)
+                partial.assign(weights.size(), 0.0f);
+
+            #pragma omp parallel
+            {
+                float* partial = threadWeightGrads[omp_get_thread_num()].data();
+
+                #pragma omp for
+                for (usize n = 0; n < batchSize; n++) {
+                    float* gradImage = gradInput.ptr() + n * x * y * channels;
+                    std::fill_n(gradImage, x * y * channels, 0.0f);
+
+                    for (usize ox = 0; ox < outX; ox++) {
+                        for (usize oy = 0; oy < outY; oy++) {
+                            const usize originOffset = ((n * x + ox * stride) * y + oy * stride) * channels;
+                            const float* go = gradOutput.ptr() + ((n * outX + ox) * outY + oy) * channels;
+
+                            for (usize tap = 0; tap < taps; tap++) {
+                                const usize offset = originOffset + tapOffset(tap);
+                                const float* input = in + offset;
+                                const float* kernel = weights.ptr() + tap * channels;
+                                float* grad = gradInput.ptr() + offset;
+                                float* kernelGrad = partial + tap * channels;
+
+                                #pragma omp simd
+                                for (usize c = 0; c < channels; c++) {
+                                    grad[c] += go[c] * kernel[c];
+                                    kernelGrad[c] += go[c] * input[c];
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+
+            for (const auto& partial : threadWeightGrads)
+                cblas_saxpy(weightGrad.size(), scale, partial.data(), 1, weightGrad.ptr(), 1);
+        }
+
+        std::unique_ptr<Layer> clone() override {
+            return std::make_unique<DepthwiseConvolution>(*this);
+        }
+
+        std::string str() const override {
+            return fmt::format("Depthwise convolution - {}x{} kernels over {} channels to {}x{}x{} output features", kernelSize, kernelSize, channels, outX, outY, channels);
+        }
+        u64 numParams() const override { return weights.size() + biases.size(); }
+    };
+
+    // 1x1 convolution, every pixel goes through the same linear layer.
+    // On (batch, x, y, channels) tensors the pixels are already the rows
+    // of a matrix, so no patches are lowered
+    struct PointwiseConvolution : internal::ComputeLayer {
+        // Weights are stored by kernel, weights[kernel][input channel]
+
+        usize numKernels;
+        usize inputChannels;
+
+        explicit PointwiseConvolution(const usize numKernels) : ComputeLayer(0), numKernels(numKernels) {
+            inputChannels = 0;
+            biases.resize(numKernels);
+        }
+
+        void init(const Tensor& previous) override {
+            // Batch size, x, y, channels
+            assert(previous.dimensionality == 4);
+
+            inputChannels = previous.dim(3);
+
+            values.resize(static_cast<usize>(1), previous.dim(1), previous.dim(2), numKernels);
+            weights.resize(numKernels, inputChannels);
+        }
+
+        // Forward pass
+        // values: (pixels x numKernels) = (pixels x inputChannels) * weights^T + biases
+        void forward(const Layer& previous) override {
+            const usize pixels = values.size() / numKernels;
+
+            for (usize p = 0; p < pixels; p++)
+                std::memcpy(values.ptr() + p * numKernels, biases.ptr(), numKernels * sizeof(float));
+
+            if (bf16Gemm) {
+                internal::toBf16(weights.ptr(), halfWeights, weights.size());
+                internal::toBf16(previous.values.ptr(), halfInput, previous.values.size());
+
+                internal::bf16gemm(CblasNoTrans, CblasTrans, pixels, numKernels, inputChannels, 1.0f, halfInput.data(), inputChannels, halfWeights.data(), inputChannels, 1.0f, values.ptr(), numKernels);
+            }
+            else {
+                sgemm(
+                    CblasRowMajor, CblasNoTrans, CblasTrans,
+                    pixels, numKernels, inputChannels,
+                    1.0f,
+                    previous.values.ptr(), inputChannels,
+                    weights.ptr(), inputChannels,
+                    1.0f,
+                    values.ptr(), numKernels
+                );
+            }
+        }
+
+        void backward(const Layer& previous, const Tensor& gradOutput, Tensor& gradInput, Tensor& weightGrad, Tensor& biasGrad, const float scale) const override {
+            const usize pixels = values.size() / numKernels;
+
+            gradInput.resize(previous.values.dims());
+
+            if (bf16Gemm) {
+                internal::toBf16(gradOutput.ptr(), halfGrad, gradOutput.size());
+
+                internal::bf16gemm(CblasNoTrans, CblasNoTrans, pixels, inputChannels, numKernels, 1.0f, halfGrad.data(), numKernels, halfWeights.data(), inputChannels, 0.0f, gradInput.ptr(), inputChannels);
+                internal::bf16gemm(CblasTrans, CblasNoTrans, numKernels, inputChannels, pixels, scale, halfGrad.data(), numKernels, halfInput.data(), inputChannels, 1.0f, weightGrad.ptr(), inputChannels);
+            }
+            else {
+                // gradInput = (pixels x numKernels) * (numKernels x inputChannels)
+                sgemm(
+                    CblasRowMajor, CblasNoTrans, CblasNoTrans,
+                    pixels, inputChannels, numKernels,
+                    1.0f,
+                    gradOutput.ptr(), numKernels,
+                    weights.ptr(), inputChannels,
+                    0.0f,
+                    gradInput.ptr(), inputChannels
+                );
+
+                // weightGrad += scale * (numKernels x pixels) * (pixels x inputChannels)
+                weightGrad.madd(CblasTrans, CblasNoTrans, numKernels, inputChannels, pixels, scale, gradOutput.ptr(), numKernels, previous.values.ptr(), inputChannels, 1.0f);
+            }
+
+            for (usize p = 0; p < pixels; p++)
+                for (usize k = 0; k < numKernels; k++)
+                    biasGrad[k] += scale * gradOutput.data[p * numKernels + k];
+        }
+
+        std::unique_ptr<Layer> clone() override {
+            return std::make_unique<PointwiseConvolution>(*this);
+        }
+
+        std::string str() const override {
+            return fmt::format("Pointwise convolution - {} kernels over {} input channels to {} output features", numKernels, inputChannels, dims());
+        }
+        u64 numParams() const override { return weights.size() + biases.size(); }
+    };
+}
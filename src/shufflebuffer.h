@@ -0,0 +1,135 @@
+#pragma once
+
+#include "types.h"
+
+#include "../external/fmt/format.h"
+
+#include <functional>
+#include <algorithm>
+#include <cassert>
+#include <numeric>
+#include <future>
+#include <random>
+#include <vector>
+
+namespace Ember::internal {
+    // Shuffles datasets that are streamed rather than held in memory
+    // Chunks of the dataset are read in a random order into a large
+    // buffer which is shuffled before samples are drawn from it, so
+    // samples are mixed across the whole file while every read stays
+    // sequential within a chunk. The next buffer is filled on another
+    // thread while the current one is drawn from, so a refill only
+    // stalls the reader if it takes longer than drawing a whole buffer
+    template <typename T>
+    struct ShuffleBuffer {
+        // readChunk(chunk, samples) appends every sample of a chunk
+        using ChunkReader = std::function<void(usize, std::vector<T>&)>;
+
+        usize numChunks = 0;
+        usize capacity = 0;
+
+        ChunkReader readChunk;
+
+        std::vector<usize> chunkOrder;
+        usize nextChunk = 0;
+
+        std::vector<T> samples;
+        usize nextSample = 0;
+
+        std::mt19937_64 rng{ std::random_device{}() };
+
+        ShuffleBuffer() = default;
+        ShuffleBuffer(const usize numChunks, const usize capacity, ChunkReader readChunk) : numChunks(numChunks), capacity(capacity), readChunk(std::move(readChunk)) {
+            chunkOrder.resize(numChunks);
+            std::iota(chunkOrder.begin(), chunkOrder.end(), 0);
+            nextChunk = numChunks;
+        }
+
+        // Background fills hold a pointer to the buffer
+        ShuffleBuffer(const ShuffleBuffer&) = delete;
+        ShuffleBuffer& operator=(const ShuffleBuffer&) = delete;
+
+        ShuffleBuffer& operator=(ShuffleBuffer&& other) noexcept {
+            if (this != &other) {
+                assert(!other.pending.valid());
+                waitForFill();
+
+                numChunks = other.numChunks;
+                capacity = other.capacity;
+                readChunk = std::move(other.readChunk);
+                chunkOrder = std::move(other.chunkOrder);
+                nextChunk = other.nextChunk;
+                samples = std::move(other.samples);
+                nextSample = other.nextSample;
+                rng = other.rng;
+                spare.clear();
+            }
+            return *this;
+        }
+
+        // Only reads the chunks with chunk % count == rank
+        void setShard(const usize rank, const usize count) {
+            waitForFill();
+
+            chunkOrder.clear();
+            for (usize chunk = rank; chunk < numChunks; chunk += count)
+                chunkOrder.push_back(chunk);
+
+            if (chunkOrder.empty())
+                exitWithMsg(fmt::format("Cannot split {} chunks into {} shards", numChunks, count), 1);
+
+            nextChunk = chunkOrder.size();
+
+            // Buffered samples may come from other shards
+            samples.clear();
+            spare.clear();
+            nextSample = 0;
+        }
+
+        // Not thread safe, callers drawing from several threads lock around it
+        T next() {
+            while (nextSample == samples.size()) {
+                if (pending.valid())
+                    pending.get();
+                else
+                    fill(spare);
+
+                std::swap(samples, spare);
+                nextSample = 0;
+
+                pending = std::async(std::launch::async, [this] { fill(spare); });
+            }
+            return samples[nextSample++];
+        }
+
+        ~ShuffleBuffer() { waitForFill(); }
+
+       private:
+        // Buffer filled in the background, and the fill in progress
+        std::vector<T> spare;
+        std::future<void> pending;
+
+        void waitForFill() {
+            if (pending.valid())
+                pending.get();
+        }
+
+        void fill(std::vector<T>& out) {
+            assert(numChunks > 0);
+
+            out.clear();
+
+            // Read at most one pass over the data so small
+            // datasets don't get duplicated samples in a buffer
+            for (usize chunksRead = 0; out.size() < capacity && chunksRead < chunkOrder.size(); chunksRead++) {
+                if (nextChunk == chunkOrder.size()) {
+                    std::ranges::shuffle(chunkOrder, rng);
+                    nextChunk = 0;
+                }
+                readChunk(chunkOrder[nextChunk++], out);
+            }
+
+            std::ranges::shuffle(out, rng);
+        }
+    };
+}
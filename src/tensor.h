@@ -7,20 +7,155 @@
 #include <cblas.h>
 #include <vector>
 #include <array>
+#include <new>
 
 namespace Ember {
-    #define sgemm cblas_sgemm;
+    #define sgemm cblas_sgemm
 
     namespace internal {
         template <typename T>
         concept UsizeLike = std::is_same_v<std::decay_t<T>, usize>;
+
+        // Alignment of flat parameter buffers in bytes and floats
+        constexpr usize ARENA_ALIGNMENT = 64;
+        constexpr usize ARENA_ALIGNMENT_FLOATS = ARENA_ALIGNMENT / sizeof(float);
+
+        template <typename T, usize Alignment>
+        struct AlignedAllocator {
+            using value_type = T;
+
+            template <typename U>
+            struct rebind { using other = AlignedAllocator<U, Alignment>; };
+
+            AlignedAllocator() = default;
+            template <typename U>
+            AlignedAllocator(const AlignedAllocator<U, Alignment>&) {}
+
+            T* allocate(const usize n) {
+                return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(Alignment)));
+            }
+            void deallocate(T* ptr, [[maybe_unused]] const usize n) {
+                ::operator delete(ptr, std::align_val_t(Alignment));
+            }
+
+            template <typename U>
+            bool operator==(const AlignedAllocator<U, Alignment>&) const { return true; }
+        };
+
+        // Contiguous floats aligned for vector loads, the layer
+        // tensors of a network and its optimizer view into these
+        using Arena = std::vector<float, AlignedAllocator<float, ARENA_ALIGNMENT>>;
+
+        // Rounds a float count up so the next segment stays aligned
+        constexpr usize alignedSize(const usize size) {
+            return (size + ARENA_ALIGNMENT_FLOATS - 1) / ARENA_ALIGNMENT_FLOATS * ARENA_ALIGNMENT_FLOATS;
+        }
+
+        // Float storage of a tensor, either owned or a view of floats
+        // owned by something else. A view can be resized up to the size
+        // it was created with and assigning to it copies into the viewed
+        // floats. Copies are always owning
+        struct TensorData {
+            TensorData() = default;
+            explicit TensorData(const usize size) : owned(size) {}
+            TensorData(const std::vector<float>& values) : owned(values) {}
+
+            TensorData(const TensorData& other) : owned(other.begin(), other.end()) {}
+            TensorData(TensorData&& other) noexcept {
+                if (other.isView())
+                    owned.assign(other.begin(), other.end());
+                else
+                    owned = std::move(other.owned);
+            }
+
+            TensorData& operator=(const TensorData& other) {
+                if (this != &other)
+                    assign(other.begin(), other.end());
+                return *this;
+            }
+            TensorData& operator=(TensorData&& other) noexcept {
+                if (isView() || other.isView())
+                    assign(other.begin(), other.end());
+                else
+                    owned = std::move(other.owned);
+                return *this;
+            }
+
+            // Views the given floats instead of owning any
+            void view(float* ptr, const usize size) {
+                owned.clear();
+                owned.shrink_to_fit();
+                viewed = ptr;
+                viewSize = viewCapacity = size;
+                detached = false;
+            }
+
+            bool isView() const { return viewed != nullptr; }
+
+            // Stops viewing and owns size zeroed floats
+            void own(const usize size = 0) {
+                viewed = nullptr;
+                viewSize = viewCapacity = 0;
+                detached = false;
+                owned.assign(size, 0.0f);
+            }
+
+            // Holds no floats but takes any size without allocating, so a
+            // tensor can be shaped before the memory it will view exists.
+            // The floats must not be accessed until view or own is called
+            void detach() {
+                owned.clear();
+                owned.shrink_to_fit();
+                viewed = nullptr;
+                viewSize = viewCapacity = 0;
+                detached = true;
+            }
+
+            void resize(const usize size) {
+                if (detached)
+                    viewSize = size;
+                else if (isView()) {
+                    if (size > viewCapacity)
+                        exitWithMsg(fmt::format("Cannot grow a tensor view of {} floats to {}", viewCapacity, size), 1);
+                    viewSize = size;
+                }
+                else
+                    owned.resize(size);
+            }
+
+            void assign(const float* first, const float* last) {
+                resize(last - first);
+                std::copy(first, last, data());
+            }
+
+            float* data() { return isView() ? viewed : owned.data(); }
+            const float* data() const { return isView() ? viewed : owned.data(); }
+
+            usize size() const { return isView() || detached ? viewSize : owned.size(); }
+            bool empty() const { return size() == 0; }
+
+            float& operator[](const usize i) { return data()[i]; }
+            const float& operator[](const usize i) const { return data()[i]; }
+
+            float* begin() { return data(); }
+            const float* begin() const { return data(); }
+            float* end() { return data() + size(); }
+            const float* end() const { return data() + size(); }
+
+           private:
+            std::vector<float> owned;
+            float* viewed = nullptr;
+            usize viewSize = 0;
+            usize viewCapacity = 0;
+            bool detached = false;
+        };
     }
 
     struct Tensor {
         usize dimensionality;
 
         std::vector<usize> dimensions;
-        std::vector<float> data;
+        internal::TensorData data;
         std::vector<usize> strides;
 
         Tensor() = default;
@@ -233,4 +368,35 @@ namespace Ember {
             );
         }
     };
+
+    // A batch of binary inputs stored as the indices of the active features
+    // Every sample has maxActive slots, active features are packed at the
+    // front and the unused slots are set to -1
+    struct SparseTensor {
+        usize batchSize = 0;
+        usize numFeatures = 0;
+        usize maxActive = 0;
+
+        std::vector<i32> indices;
+
+        SparseTensor() = default;
+
+        SparseTensor(const usize batchSize, const usize numFeatures, const usize maxActive) {
+            resize(batchSize, numFeatures, maxActive);
+        }
+
+        void resize(const usize batchSize, const usize numFeatures, const usize maxActive) {
+            this->batchSize = batchSize;
+            this->numFeatures = numFeatures;
+            this->maxActive = maxActive;
+            indices.resize(batchSize * maxActive);
+        }
+
+        void clear() {
+            std::fill(indices.begin(), indices.end(), -1);
+        }
+
+        i32* sample(const usize i) { return indices.data() + i * maxActive; }
+        const i32* sample(const usize i) const { return indices.data() + i * maxActive; }
+    };
 }
\ No newline at end of file
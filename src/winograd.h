@@ -0,0 +1,168 @@
+#pragma once
+
+#include "types.h"
+
+#include <cblas.h>
+#include <algorithm>
+#include <vector>
+
+// Winograd F(2x2, 3x3) kernels for stride 1 3x3 convolutions on
+// (batch, x, y, channels) tensors. Each 2x2 output tile comes from a
+// 4x4 input tile with 16 multiplications per channel pair instead of 36
+namespace Ember::internal::winograd {
+    // Floats of transformed input kept at once, samples are processed
+    // in chunks of at most this size
+    constexpr usize MAX_TRANSFORM_FLOATS = 1 << 22;
+
+    // Transforms 3x3 kernels weights[o][i * 9 + ky * 3 + kx] into 16
+    // planes of outChannels x inChannels, out[p][o][i] where p indexes
+    // the 4x4 tile as x * 4 + y. With flip the kernels are rotated and
+    // their channels swapped, giving the kernels of the input gradient
+    inline void transformKernels(const float* weights, const usize outChannels, const usize inChannels, const bool flip, std::vector<float>& out) {
+        const usize planeOut = flip ? inChannels : outChannels;
+        const usize planeIn = flip ? outChannels : inChannels;
+
+        out.resize(16 * planeOut * planeIn);
+
+        #pragma omp parallel for
+        for (usize o = 0; o < outChannels; o++) {
+            for (usize i = 0; i < inChannels; i++) {
+                const float* w = weights + (o * inChannels + i) * 9;
+
+                // g[a][b] multiplies input offset (a, b) in (x, y)
+                float g[3][3];
+                for (usize a = 0; a < 3; a++)
+                    for (usize b = 0; b < 3; b++)
+                        g[a][b] = flip ? w[(2 - b) * 3 + (2 - a)] : w[b * 3 + a];
+
+                // G g
+                float gg[4][3];
+                for (usize b = 0; b < 3; b++) {
+                    gg[0][b] = g[0][b];
+                    gg[1][b] = 0.5f * (g[0][b] + g[1][b] + g[2][b]);
+                    gg[2][b] = 0.5f * (g[0][b] - g[1][b] + g[2][b]);
+                    gg[3][b] = g[2][b];
+                }
+
+                // (G g) G^T
+                float u[4][4];
+                for (usize a = 0; a < 4; a++) {
+                    u[a][0] = gg[a][0];
+                    u[a][1] = 0.5f * (gg[a][0] + gg[a][1] + gg[a][2]);
+                    u[a][2] = 0.5f * (gg[a][0] - gg[a][1] + gg[a][2]);
+                    u[a][3] = gg[a][2];
+                }
+
+                const usize row = flip ? i : o;
+                const usize col = flip ? o : i;
+                for (usize p = 0; p < 16; p++)
+                    out[(p * planeOut + row) * planeIn + col] = u[p / 4][p % 4];
+            }
+        }
+    }
+
+    // out[n][ox][oy][o] = bias[o] + sum over i, a, b of
+    // in[n][ox + a - pad][oy + b - pad][i] * kernel[o][i][a][b]
+    // where input outside the image is 0 and kernels were
+    // transformed by transformKernels. bias may be null
+    inline void correlate(const float* in, const usize batchSize, const usize inX, const usize inY, const usize inChannels, const usize pad,
+     const std::vector<float>& kernels, const usize outChannels, const usize outX, const usize outY, const float* bias, float* out,
+     std::vector<float>& transformed, std::vector<float>& products) {
+        const usize tilesX = (outX + 1) / 2;
+        const usize tilesY = (outY + 1) / 2;
+        const usize tilesPerSample = tilesX * tilesY;
+        const usize chunkSamples = std::clamp<usize>(MAX_TRANSFORM_FLOATS / (16 * tilesPerSample * std::max(inChannels, outChannels)), 1, batchSize);
+
+        transformed.resize(16 * chunkSamples * tilesPerSample * inChannels);
+        products.resize(16 * chunkSamples * tilesPerSample * outChannels);
+
+        for (usize first = 0; first < batchSize; first += chunkSamples) {
+            const usize count = std::min(chunkSamples, batchSize - first);
+            const usize numTiles = count * tilesPerSample;
+
+            // transformed[p][tile][i] = (B^T d B)[p] of the tile's input
+            #pragma omp parallel for
+            for (usize tile = 0; tile < numTiles; tile++) {
+                const usize n = first + tile / tilesPerSample;
+                const i64 tx = static_cast<i64>(tile % tilesPerSample / tilesY * 2) - static_cast<i64>(pad);
+                const i64 ty = static_cast<i64>(tile % tilesY * 2) - static_cast<i64>(pad);
+
+                for (usize i = 0; i < inChannels; i++) {
+                    float d[4][4];
+                    for (i64 a = 0; a < 4; a++) {
+                        for (i64 b = 0; b < 4; b++) {
+                            const i64 ix = tx + a;
+                            const i64 iy = ty + b;
+                            d[a][b] = ix >= 0 && iy >= 0 && ix < static_cast<i64>(inX) && iy < static_cast<i64>(inY)
+                                    ? in[((n * inX + ix) * inY + iy) * inChannels + i] : 0.0f;
+                        }
+                    }
+
+                    // B^T d
+                    float bd[4][4];
+                    for (usize b = 0; b < 4; b++) {
+                        bd[0][b] = d[0][b] - d[2][b];
+                        bd[1][b] = d[1][b] + d[2][b];
+                        bd[2][b] = d[2][b] - d[1][b];
+                        bd[3][b] = d[1][b] - d[3][b];
+                    }
+
+                    // (B^T d) B
+                    for (usize a = 0; a < 4; a++) {
+                        float* v = &transformed[((a * 4) * numTiles + tile) * inChannels + i];
+                        const usize plane = numTiles * inChannels;
+                        v[0]         = bd[a][0] - bd[a][2];
+                        v[plane]     = bd[a][1] + bd[a][2];
+                        v[2 * plane] = bd[a][2] - bd[a][1];
+                        v[3 * plane] = bd[a][1] - bd[a][3];
+                    }
+                }
+            }
+
+            // products[p] = transformed[p] * kernels[p]^T, one matrix product per tile position
+            for (usize p = 0; p < 16; p++) {
+                cblas_sgemm(
+                    CblasRowMajor, CblasNoTrans, CblasTrans,
+                    numTiles, outChannels, inChannels,
+                    1.0f,
+                    &transformed[p * numTiles * inChannels], inChannels,
+                    &kernels[p * outChannels * inChannels], inChannels,
+                    0.0f,
+                    &products[p * numTiles * outChannels], outChannels
+                );
+            }
+
+            // A^T m A gives the 2x2 outputs, clipped at odd edges
+            #pragma omp parallel for
+            for (usize tile = 0; tile < numTiles; tile++) {
+                const usize n = first + tile / tilesPerSample;
+                const usize ox = tile % tilesPerSample / tilesY * 2;
+                const usize oy = tile % tilesY * 2;
+
+                for (usize o = 0; o < outChannels; o++) {
+                    float m[4][4];
+                    for (usize p = 0; p < 16; p++)
+                        m[p / 4][p % 4] = products[(p * numTiles + tile) * outChannels + o];
+
+                    // A^T m
+                    float am[2][4];
+                    for (usize b = 0; b < 4; b++) {
+                        am[0][b] = m[0][b] + m[1][b] + m[2][b];
+                        am[1][b] = m[1][b] - m[2][b] - m[3][b];
+                    }
+
+                    const float offset = bias ? bias[o] : 0.0f;
+                    for (usize a = 0; a < 2 && ox + a < outX; a++) {
+                        const float y0 = am[a][0] + am[a][1] + am[a][2];
+                        const float y1 = am[a][1] - am[a][2] - am[a][3];
+
+                        float* row = out + ((n * outX + ox + a) * outY + oy) * outChannels + o;
+                        row[0] = y0 + offset;
+                        if (oy + 1 < outY)
+                            row[outChannels] = y1 + offset;
+                    }
+                }
+            }
+        }
+    }
+}
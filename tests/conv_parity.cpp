@@ -0,0 +1,116 @@
+// Checks that every Convolution algorithm agrees with im2col on the
+// forward pass, the input gradient and the weight and bias gradients
+// Usage: ConvParity
+
+#include "../src/convolution.h"
+
+#include <random>
+
+using namespace Ember;
+
+constexpr float TOLERANCE = 1e-4f;
+
+struct Shape {
+    usize x;
+    usize y;
+    usize channels;
+    usize kernels;
+    usize kernelSize;
+    usize stride;
+    usize batchSize;
+};
+
+struct Result {
+    Tensor output;
+    Tensor gradInput;
+    Tensor weightGrad;
+    Tensor biasGrad;
+};
+
+// Largest difference relative to the magnitude of the reference
+float maxError(const Tensor& reference, const Tensor& other) {
+    if (reference.size() != other.size())
+        return std::numeric_limits<float>::infinity();
+
+    float error = 0;
+    for (usize i = 0; i < reference.size(); i++)
+        error = std::max(error, std::abs(reference.data[i] - other.data[i]) / std::max(1.0f, std::abs(reference.data[i])));
+    return error;
+}
+
+Result run(const Shape& shape, const layers::ConvolutionAlgorithm algorithm, const bool cachePatches, const u64 seed) {
+    std::mt19937 gen(seed);
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+
+    layers::Input input(shape.x, shape.y, shape.channels);
+    layers::Convolution conv(shape.kernels, shape.kernelSize, shape.stride);
+    conv.init(input.values);
+    conv.algorithm = algorithm;
+    conv.cachePatches = cachePatches;
+
+    input.setBatchSize(shape.batchSize);
+    conv.setBatchSize(shape.batchSize);
+
+    // Every run draws the same values in the same order
+    for (auto& v : input.values)
+        v = dist(gen);
+    for (auto& w : conv.weights)
+        w = dist(gen);
+    for (auto& b : conv.biases)
+        b = dist(gen);
+
+    conv.forward(input);
+
+    Tensor gradOutput(conv.values.dims());
+    for (auto& g : gradOutput)
+        g = dist(gen);
+
+    Result result;
+    result.output = conv.values;
+    result.weightGrad.resize(conv.weights.dims());
+    result.weightGrad.fill(0);
+    result.biasGrad.resize(conv.biases.dims());
+    result.biasGrad.fill(0);
+
+    conv.backward(input, gradOutput, result.gradInput, result.weightGrad, result.biasGrad, 0.5f);
+
+    return result;
+}
+
+int main() {
+    const std::vector<Shape> shapes = {
+        { 6, 6, 3, 4, 3, 1, 2 },
+        { 7, 7, 3, 5, 3, 1, 3 },
+        { 9, 8, 2, 3, 3, 1, 1 },
+        { 8, 8, 5, 6, 3, 2, 2 },
+        { 11, 9, 1, 4, 5, 1, 2 },
+        { 10, 10, 4, 3, 2, 2, 3 }
+    };
+
+    bool passed = true;
+
+    for (usize s = 0; s < shapes.size(); s++) {
+        const Shape& shape = shapes[s];
+        const Result reference = run(shape, layers::ConvolutionAlgorithm::IM2COL, false, s);
+
+        std::vector<std::pair<std::string, Result>> results;
+        results.emplace_back("im2col cached", run(shape, layers::ConvolutionAlgorithm::IM2COL, true, s));
+        results.emplace_back("direct", run(shape, layers::ConvolutionAlgorithm::DIRECT, false, s));
+        if (shape.kernelSize == 3 && shape.stride == 1)
+            results.emplace_back("winograd", run(shape, layers::ConvolutionAlgorithm::WINOGRAD, false, s));
+
+        for (const auto& [name, result] : results) {
+            const float error = std::max({ maxError(reference.output, result.output),
+                                           maxError(reference.gradInput, result.gradInput),
+                                           maxError(reference.weightGrad, result.weightGrad),
+                                           maxError(reference.biasGrad, result.biasGrad) });
+
+            const bool ok = error <= TOLERANCE;
+            passed &= ok;
+
+            fmt::println("{} {}x{}x{} {} {}x{} kernels stride {}: {} max error {:.2e}", ok ? "PASS" : "FAIL", shape.x, shape.y, shape.channels, shape.kernels, shape.kernelSize, shape.kernelSize, shape.stride, name, error);
+        }
+    }
+
+    return passed ? 0 : 1;
+}
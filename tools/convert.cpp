@@ -0,0 +1,101 @@
+// Converts Bullet text files ("fen | eval | wdl" per line)
+// into the packed binary position format
+// Usage: BulletConvert <input> <output> [threads]
+
+#include "../src/chess/board.h"
+#include "../src/mappedfile.h"
+#include "../src/lineindex.h"
+#include "../src/progbar.h"
+#include "../src/util.h"
+
+#include <algorithm>
+#include <fstream>
+#include <limits>
+#include <omp.h>
+
+using namespace Ember;
+
+// Bytes of text each thread parses per block
+constexpr usize BYTES_PER_THREAD = 8 * 1024 * 1024;
+
+// Parses every line in [begin, end) into packed positions
+void parseRange(const internal::MappedFile& file, const usize begin, const usize end, std::vector<chess::PackedBoard>& out) {
+    out.clear();
+
+    usize pos = begin;
+    while (pos < end) {
+        const usize next = internal::nextLineStart(file, pos);
+        std::string line(reinterpret_cast<const char*>(file.data + pos), next - pos);
+        pos = next;
+
+        // Discard null chars because windows uses encoding that
+        // places a \0 after every character
+        std::erase_if(line, [](const char c) { return c == '\0'; });
+
+        // Strip UTF-16 BOM if present
+        if (line.size() >= 2 && static_cast<unsigned char>(line[0]) == 0xFF && static_cast<unsigned char>(line[1]) == 0xFE)
+            line = line.substr(2);
+
+        if (std::ranges::all_of(line, [](const char c) { return std::isspace(static_cast<unsigned char>(c)); }))
+            continue;
+
+        const auto tokens = split(line, '|');
+        if (tokens.size() != 3)
+            exitWithMsg(fmt::format("Expected 3 tokens, got {}. Failed to parse line: {}", tokens.size(), line), 1);
+
+        chess::Board board{};
+        board.loadFromFEN(tokens[0]);
+
+        const float eval = std::clamp<float>(std::round(std::stof(tokens[1])), std::numeric_limits<i16>::min(), std::numeric_limits<i16>::max());
+        const auto wdl = static_cast<u8>(std::round(std::stof(tokens[2]) * 2));
+
+        out.push_back(board.pack(static_cast<i16>(eval), wdl));
+    }
+}
+
+int main(const int argc, char* argv[]) {
+    if (argc < 3)
+        exitWithMsg("Usage: BulletConvert <input> <output> [threads]", 1);
+
+    const std::string inputPath = argv[1];
+    const std::string outputPath = argv[2];
+    const usize threads = argc > 3 ? std::max(std::stoi(argv[3]), 1) : std::max(omp_get_num_procs(), 1);
+
+    const internal::MappedFile input(inputPath);
+    std::ofstream output(outputPath, std::ios::binary);
+    if (!output)
+        exitWithMsg("Failed to open output file: " + outputPath, 1);
+
+    fmt::println("Converting '{}' to '{}' using {} threads", inputPath, outputPath, threads);
+
+    std::vector<std::vector<chess::PackedBoard>> parsed(threads);
+    std::vector<usize> bounds(threads + 1);
+
+    ProgressBar progressBar{};
+    u64 positions = 0;
+
+    for (usize blockStart = 0; blockStart < input.size;) {
+        // Split the block into line aligned ranges, one per thread
+        bounds[0] = blockStart;
+        for (usize t = 1; t <= threads; t++)
+            bounds[t] = std::max(bounds[t - 1], internal::nextLineStart(input, std::min(input.size, blockStart + t * BYTES_PER_THREAD) - 1));
+
+        #pragma omp parallel for num_threads(threads) schedule(static, 1)
+        for (usize t = 0; t < threads; t++)
+            parseRange(input, bounds[t], bounds[t + 1], parsed[t]);
+
+        // Ranges are written in file order so the output is deterministic
+        for (const auto& chunk : parsed) {
+            output.write(reinterpret_cast<const char*>(chunk.data()), chunk.size() * sizeof(chess::PackedBoard));
+            positions += chunk.size();
+        }
+
+        blockStart = bounds[threads];
+
+        internal::cursor::clear();
+        std::cout << progressBar.report(blockStart / 1024, input.size / 1024, 50) << std::flush;
+    }
+
+    std::cout << std::endl;
+    fmt::println("Wrote {} positions", formatNum(positions));
+}